@@ -1,9 +1,35 @@
-#include <ctype.h>
+#define _POSIX_C_SOURCE 200809L // clock_gettime, getrusage
+#define _DEFAULT_SOURCE          // syscall() for perf_event_open on glibc
+#include <ctype.h> // toupper
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h> // open
+#include <pthread.h>
+#include <sched.h> // sched_yield
+#include <stdatomic.h>
+#include <stddef.h> // max_align_t
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#define MAX_LEXEME_LEN 256
+#include <sys/file.h> // flock
+#include <sys/mman.h>
+#include <sys/resource.h> // getrusage
+#include <sys/stat.h>
+#include <unistd.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h> // __rdtsc
+#endif
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
 #define MAX_ID_LEN 64 // "reasonable" identifier limit
+#ifndef LEXER_STATS
+#define LEXER_STATS 1 // build with -DLEXER_STATS=0 to compile --stats out
+#endif
 typedef enum {
   TOK_EOF,
   TOK_KEYWORD,
@@ -15,409 +41,5920 @@ typedef enum {
   TOK_OPERATOR,
   TOK_SEPARATOR,
   TOK_UNKNOWN,
+  TOK_COMMENT, // only with --comments
   TOK_ERROR
 } TokenType;
+#define TOKEN_TYPE_COUNT (TOK_ERROR + 1)
+// Comments are trivia unless asked for, so "all" leaves them out.
+#define TOKEN_MASK_ALL (((1u << TOKEN_TYPE_COUNT) - 1) & ~(1u << TOK_COMMENT))
+// EOF and errors end every token stream, so filters never drop them.
+#define TOKEN_MASK_ALWAYS ((1u << TOK_EOF) | (1u << TOK_ERROR))
+
+// Which keyword, operator or separator a token is, set by the scanner that
+// recognized it, so consumers switch on an id instead of comparing lexemes.
+// KIND_NONE for every other token type.
+typedef enum {
+  KIND_NONE,
+  // Keywords, in KEYWORDS[] order
+  KW_IF,
+  KW_ELSE,
+  KW_WHILE,
+  KW_FOR,
+  KW_RETURN,
+  KW_INT,
+  KW_FLOAT,
+  KW_CHAR,
+  KW_VOID,
+  KW_BREAK,
+  KW_CONTINUE,
+  KW_STRUCT,
+  KW_CONST,
+  // Single-byte operators
+  OP_PLUS,     // +
+  OP_MINUS,    // -
+  OP_STAR,     // *
+  OP_SLASH,    // /
+  OP_PERCENT,  // %
+  OP_LT,       // <
+  OP_GT,       // >
+  OP_ASSIGN,   // =
+  OP_NOT,      // !
+  OP_AMP,      // &
+  OP_PIPE,     // |
+  OP_CARET,    // ^
+  OP_TILDE,    // ~
+  OP_QUESTION, // ?
+  OP_COLON,    // :
+  OP_DOT,      // .
+  // Two-byte operators
+  OP_EQ,         // ==
+  OP_NE,         // !=
+  OP_LE,         // <=
+  OP_GE,         // >=
+  OP_AND,        // &&
+  OP_OR,         // ||
+  OP_INC,        // ++
+  OP_DEC,        // --
+  OP_ADD_ASSIGN, // +=
+  OP_SUB_ASSIGN, // -=
+  OP_MUL_ASSIGN, // *=
+  OP_DIV_ASSIGN, // /=
+  OP_MOD_ASSIGN, // %=
+  OP_ARROW,      // ->
+  // Separators
+  SEP_LPAREN,   // (
+  SEP_RPAREN,   // )
+  SEP_LBRACE,   // {
+  SEP_RBRACE,   // }
+  SEP_LBRACKET, // [
+  SEP_RBRACKET, // ]
+  SEP_SEMI,     // ;
+  SEP_COMMA,    // ,
+  // Comments
+  CMT_LINE,  // // ...
+  CMT_BLOCK, // /* ... */
+  CMT_DOC,   // /// ... or /** ... */
+  KIND_COUNT
+} TokenKind;
 
 typedef struct {
   TokenType type;
-  char lexeme[MAX_LEXEME_LEN];
+  const char *lexeme; // NUL-terminated; owned by the Lexer's arena
+  size_t len;
   int line;
   int col;
+  uint32_t sym;   // interned identifier id (--symbols), 0 otherwise
+  TokenKind kind; // keyword/operator/separator id, KIND_NONE otherwise
+  uint64_t hash;  // identifiers, keywords, strings: lex_hash64 of lexeme
 } Token;
 
+typedef enum {
+  LEX_ERR_NONE,
+  LEX_ERR_STRING,
+  LEX_ERR_CHAR,
+  LEX_ERR_CHAR_INVALID
+} LexError;
+
+static const char *LEX_ERROR_MESSAGES[] = {
+    "", "Unterminated string literal", "Unterminated char literal",
+    "Invalid/unterminated char literal"};
+
+// A token as recognized by the scanners: its kind and where it sits in the
+// source, with nothing copied. next_token() materializes a Token from it.
+typedef struct {
+  size_t start;       // offset of the first byte
+  size_t len;         // source bytes, quotes included
+  int line;           // of the first byte
+  int col;            // of the first byte
+  unsigned char type; // TokenType
+  unsigned char err;  // LexError, for TOK_ERROR
+  unsigned char kind; // TokenKind
+  uint64_t hash;      // Token.hash, computed by the scanner; 0 for others
+} RawToken;
+_Static_assert(KIND_COUNT <= 256, "RawToken stores TokenKind in a byte");
+
 /* ---------- Keywords list (extend as needed) ---------- */
 static const char *KEYWORDS[] = {
     "if",   "else", "while", "for",      "return", "int",  "float",
     "char", "void", "break", "continue", "struct", "const"};
 static const int KEYWORD_COUNT = (int)(sizeof(KEYWORDS) / sizeof(KEYWORDS[0]));
+_Static_assert(sizeof(KEYWORDS) / sizeof(KEYWORDS[0]) == KW_CONST - KW_IF + 1,
+               "one KW_* kind per keyword");
+
+#define MAX_KEYWORD_LEN 8 // "continue"
 
-static int is_keyword(const char *s) {
+// KW_* kind of the n bytes at s, or KIND_NONE if they are not a keyword.
+static TokenKind keyword_kind(const unsigned char *s, size_t n) {
+  if (n < 2 || n > MAX_KEYWORD_LEN)
+    return KIND_NONE;
   for (int i = 0; i < KEYWORD_COUNT; i++) {
-    if (strcmp(s, KEYWORDS[i]) == 0)
-      return 1;
+    // strncmp stops at the keyword's NUL, so shorter keywords are never
+    // read past their end.
+    if (KEYWORDS[i][0] == s[0] &&
+        strncmp(KEYWORDS[i], (const char *)s, n) == 0 && KEYWORDS[i][n] == '\0')
+      return (TokenKind)(KW_IF + i);
   }
-  return 0;
+  return KIND_NONE;
 }
 
-/* ---------- Global position tracking ---------- */
-static int g_line = 1;
-static int g_col = 0; // column of last read character
+/* ---------- Character classes ---------- */
+// One table lookup per byte instead of <ctype.h> calls. The sets match the
+// "C" locale: bytes >= 0x80 are never letters, digits or spaces.
+#define CH_SPACE 0x01 // isspace
+#define CH_IDENT 0x02 // isalnum or '_'
+#define CH_DIGIT 0x04 // isdigit
+#define CH_SEP 0x08   // ( ) { } [ ] ; ,
+#define CH_OP 0x10    // + - * / % < > = ! & | ^ ~ ? : .
+
+static const unsigned char CHAR_CLASS[256] = {
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x00
+    0x00, 0x01, 0x01, 0x01, 0x01, 0x01, 0x00, 0x00, // 0x08
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x10
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x18
+    0x01, 0x10, 0x00, 0x00, 0x00, 0x10, 0x10, 0x00, // 0x20
+    0x08, 0x08, 0x10, 0x10, 0x08, 0x10, 0x10, 0x10, // 0x28
+    0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, 0x06, // 0x30
+    0x06, 0x06, 0x10, 0x08, 0x10, 0x10, 0x10, 0x10, // 0x38
+    0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x40
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x48
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x50
+    0x02, 0x02, 0x02, 0x08, 0x00, 0x08, 0x10, 0x02, // 0x58
+    0x00, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x60
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x68
+    0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, 0x02, // 0x70
+    0x02, 0x02, 0x02, 0x08, 0x10, 0x08, 0x10, 0x00, // 0x78
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x80
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x88
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x90
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0x98
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xa0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xa8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xb0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xb8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xc0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xc8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xd0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xd8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xe0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xe8
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xf0
+    0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, // 0xf8
+};
+
+/* ---------- Arena allocator ---------- */
+// Bump allocation out of a chain of chunks; everything is released at once.
+// arena_reset() rewinds to the first chunk but keeps the chain, so an arena
+// that is reset between inputs stops calling malloc once it has grown to the
+// largest input's needs.
+#define ARENA_CHUNK_SIZE (64 * 1024)
 
-static int read_char(FILE *fp) {
-  int c = fgetc(fp);
-  if (c == '\n') {
-    g_line++;
-    g_col = 0;
-  } else if (c != EOF) {
-    g_col++;
+typedef struct ArenaChunk {
+  struct ArenaChunk *next;
+  size_t cap;
+  size_t used;
+  _Alignas(max_align_t) unsigned char data[];
+} ArenaChunk;
+
+typedef struct {
+  ArenaChunk *first; // oldest chunk
+  ArenaChunk *head;  // chunk currently allocated from
+} Arena;
+
+static ArenaChunk *arena_new_chunk(size_t n) {
+  size_t cap = n > ARENA_CHUNK_SIZE ? n : ARENA_CHUNK_SIZE;
+  ArenaChunk *c = malloc(sizeof(ArenaChunk) + cap);
+  if (!c) {
+    perror("malloc");
+    exit(1);
   }
+  c->next = NULL;
+  c->cap = cap;
+  c->used = 0;
   return c;
 }
 
-static void unread_char(int c, FILE *fp) {
-  if (c == EOF)
-    return;
-  ungetc(c, fp);
-  // Rollback column/line tracking conservatively:
-  // (Exact rollback for '\n' would require more state; for a simple demo,
-  // we avoid unread of '\n' in our scanner logic.)
-  if (c != '\n')
-    g_col--;
+static void *arena_alloc(Arena *a, size_t n) {
+  n = (n + 7) & ~(size_t)7;
+  ArenaChunk *c = a->head;
+  if (!c) {
+    c = a->first = a->head = arena_new_chunk(n);
+  } else if (c->cap - c->used < n) {
+    // Reuse the chunks kept by arena_reset() while they are big enough;
+    // splice in a fresh one otherwise.
+    ArenaChunk *next = c->next;
+    if (next && next->cap >= n) {
+      next->used = 0;
+    } else {
+      ArenaChunk *fresh = arena_new_chunk(n);
+      fresh->next = next;
+      next = fresh;
+    }
+    c->next = next;
+    c = a->head = next;
+  }
+  void *p = c->data + c->used;
+  c->used += n;
+  return p;
+}
+
+// Releases every allocation in O(1); the chunks are kept for reuse.
+static void arena_reset(Arena *a) {
+  if (a->first) {
+    a->first->used = 0;
+    a->head = a->first;
+  }
+}
+
+static void arena_free(Arena *a) {
+  while (a->first) {
+    ArenaChunk *next = a->first->next;
+    free(a->first);
+    a->first = next;
+  }
+  a->head = NULL;
+}
+
+/* ---------- Hashing ---------- */
+// 64-bit hash of a lexeme, folding in 8 bytes per multiply. Byte-at-a-time
+// FNV-1a is a serial multiply per byte, which cost the identifier scanner a
+// third of its speed; this one the scanners can afford on every token.
+#define HASH_SEED 0xcbf29ce484222325ULL
+#define HASH_MUL 0x9e3779b97f4a7c15ULL
+// The first r (1..7) bytes of a word loaded from memory.
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define HASH_TAIL_MASK(r) (~0ULL << (64 - 8 * (r)))
+#else
+#define HASH_TAIL_MASK(r) ((1ULL << (8 * (r))) - 1)
+#endif
+
+static inline uint64_t hash_word(uint64_t h, uint64_t w) {
+  h = (h ^ w) * HASH_MUL;
+  return h ^ (h >> 32);
+}
+
+// Loads whole words, so it reads up to 7 bytes past p[n - 1]: p must point
+// into a LEX_PAD-padded source buffer, as lexemes do.
+static inline uint64_t lex_hash64(const unsigned char *p, size_t n) {
+  uint64_t h = HASH_SEED ^ n;
+  uint64_t w;
+  for (; n >= 8; p += 8, n -= 8) {
+    memcpy(&w, p, 8);
+    h = hash_word(h, w);
+  }
+  if (n) {
+    memcpy(&w, p, 8);
+    h = hash_word(h, w & HASH_TAIL_MASK(n));
+  }
+  // Final mix so the low bits (table slot) and top bits (stripe) both
+  // depend on every input byte.
+  h ^= h >> 29;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  return h ^ (h >> 32);
+}
+
+/* ---------- Identifier interning ---------- */
+// Maps identifier text to a dense 32-bit symbol id (1, 2, 3, ...) and stores
+// each distinct text once. The table is split into INTERN_STRIPES
+// independently locked open-addressing tables chosen by hash, so batch
+// workers sharing one Interner rarely contend. Ids come from one atomic
+// counter, so the same identifier gets the same id across all files.
+#define INTERN_STRIPES 64
+#define INTERN_DIR_CHUNK 4096 // names per id-directory chunk
+#define INTERN_DIR_CHUNKS 16384
+
+typedef struct {
+  uint64_t hash;
+  const char *text;
+  uint32_t len;
+  uint32_t id; // 0 = empty slot
+} InternSlot;
+
+typedef struct {
+  pthread_mutex_t lock;
+  InternSlot *slots;
+  size_t cap; // power of two
+  size_t count;
+  Arena text;
+} InternStripe;
+
+typedef struct {
+  const char *text;
+  uint32_t len;
+} SymbolName;
+
+typedef struct {
+  InternStripe stripes[INTERN_STRIPES];
+  atomic_uint next_id;
+  // id -> name, in lazily allocated chunks so lookups never take a lock.
+  _Atomic(SymbolName *) dir[INTERN_DIR_CHUNKS];
+} Interner;
+
+static void interner_init(Interner *in) {
+  memset(in, 0, sizeof(*in));
+  for (int i = 0; i < INTERN_STRIPES; i++)
+    pthread_mutex_init(&in->stripes[i].lock, NULL);
+  atomic_init(&in->next_id, 1);
+  for (int i = 0; i < INTERN_DIR_CHUNKS; i++)
+    atomic_init(&in->dir[i], NULL);
+}
+
+static void interner_free(Interner *in) {
+  for (int i = 0; i < INTERN_STRIPES; i++) {
+    free(in->stripes[i].slots);
+    arena_free(&in->stripes[i].text);
+    pthread_mutex_destroy(&in->stripes[i].lock);
+  }
+  for (int i = 0; i < INTERN_DIR_CHUNKS; i++)
+    free(atomic_load(&in->dir[i]));
+}
+
+static uint32_t interner_count(Interner *in) {
+  return atomic_load(&in->next_id) - 1;
+}
+
+static void intern_grow(InternStripe *st) {
+  size_t cap = st->cap ? st->cap * 2 : 256;
+  InternSlot *slots = calloc(cap, sizeof(InternSlot));
+  if (!slots) {
+    perror("calloc");
+    exit(1);
+  }
+  for (size_t i = 0; i < st->cap; i++) {
+    if (!st->slots[i].id)
+      continue;
+    size_t j = (size_t)st->slots[i].hash & (cap - 1);
+    while (slots[j].id)
+      j = (j + 1) & (cap - 1);
+    slots[j] = st->slots[i];
+  }
+  free(st->slots);
+  st->slots = slots;
+  st->cap = cap;
+}
+
+static void intern_publish(Interner *in, uint32_t id, const char *text,
+                           uint32_t len) {
+  size_t chunk = id / INTERN_DIR_CHUNK;
+  if (chunk >= INTERN_DIR_CHUNKS) {
+    fprintf(stderr, "intern: too many symbols\n");
+    exit(1);
+  }
+  SymbolName *names = atomic_load(&in->dir[chunk]);
+  if (!names) {
+    SymbolName *fresh = calloc(INTERN_DIR_CHUNK, sizeof(SymbolName));
+    if (!fresh) {
+      perror("calloc");
+      exit(1);
+    }
+    if (atomic_compare_exchange_strong(&in->dir[chunk], &names, fresh))
+      names = fresh;
+    else
+      free(fresh); // another thread installed the chunk first
+  }
+  names[id % INTERN_DIR_CHUNK].text = text;
+  names[id % INTERN_DIR_CHUNK].len = len;
+}
+
+// Returns the symbol id for s[0..n), adding it if new. hash must be
+// lex_hash64(s, n), as the scanners store it in the token.
+static uint32_t intern(Interner *in, const char *s, size_t n, uint64_t hash) {
+  InternStripe *st = &in->stripes[(hash >> 58) % INTERN_STRIPES];
+  pthread_mutex_lock(&st->lock);
+
+  if (st->count * 2 >= st->cap)
+    intern_grow(st);
+  size_t j = (size_t)hash & (st->cap - 1);
+  while (st->slots[j].id) {
+    InternSlot *slot = &st->slots[j];
+    if (slot->hash == hash && slot->len == n && memcmp(slot->text, s, n) == 0) {
+      uint32_t id = slot->id;
+      pthread_mutex_unlock(&st->lock);
+      return id;
+    }
+    j = (j + 1) & (st->cap - 1);
+  }
+
+  char *text = arena_alloc(&st->text, n + 1);
+  memcpy(text, s, n);
+  text[n] = '\0';
+  uint32_t id = atomic_fetch_add(&in->next_id, 1);
+  intern_publish(in, id, text, (uint32_t)n);
+  st->slots[j].hash = hash;
+  st->slots[j].text = text;
+  st->slots[j].len = (uint32_t)n;
+  st->slots[j].id = id;
+  st->count++;
+
+  pthread_mutex_unlock(&st->lock);
+  return id;
 }
 
-static Token make_token(TokenType type, const char *lex, int line, int col) {
+// Text of a symbol id returned by intern() (NUL-terminated).
+static const char *symbol_name(Interner *in, uint32_t id) {
+  SymbolName *names = atomic_load(&in->dir[id / INTERN_DIR_CHUNK]);
+  return names ? names[id % INTERN_DIR_CHUNK].text : NULL;
+}
+
+/* ---------- Lexer state ---------- */
+// Every input buffer is followed by LEX_PAD zero bytes, so scanners may read
+// past the last byte (a zero ends every token) without bounds checks.
+#define LEX_PAD 64
+
+typedef struct LexStats LexStats;
+typedef struct LexIndex LexIndex;
+typedef struct TriviaSpan TriviaSpan;
+
+typedef struct {
+  const unsigned char *src;
+  size_t len;
+  size_t pos;        // next byte to scan
+  size_t line_start; // offset of the first byte of the current line
+  int line;
+  unsigned type_mask; // bit (1u << TokenType) set for token types to return
+  Interner *interner; // when set, identifier tokens carry a symbol id
+  Arena arena;        // lexemes and other per-input memory, see lexer_reset()
+  LexIndex *index;    // --engine=index: structural bitmaps of src, or NULL
+  TriviaSpan *trivia; // next_trivia_token(): spans around the last token
+  size_t ntrivia;
+  size_t trivia_cap;
+#if LEXER_STATS
+  LexStats *stats; // non-NULL while --stats is active
+#endif
+} Lexer;
+
+static void lexer_init(Lexer *lx) {
+  memset(lx, 0, sizeof(*lx));
+  lx->type_mask = TOKEN_MASK_ALL;
+}
+
+// Starts scanning src (followed by LEX_PAD zero bytes). Options such as
+// type_mask and interner are kept, as is anything already in the arena.
+static void lexer_set_input(Lexer *lx, const char *src, size_t len) {
+  lx->src = (const unsigned char *)src;
+  lx->len = len;
+  lx->pos = 0;
+  lx->line_start = 0;
+  lx->line = 1;
+  lx->index = NULL;
+}
+
+// Releases every token and buffer handed out for the previous input in O(1).
+// A Lexer that is reset between files stops allocating once its arena has
+// grown to fit the largest one.
+static void lexer_reset(Lexer *lx) { arena_reset(&lx->arena); }
+
+static void lexer_free(Lexer *lx) {
+  arena_free(&lx->arena);
+  free(lx->trivia);
+}
+
+static int lexer_col(const Lexer *lx, size_t pos) {
+  return (int)(pos - lx->line_start) + 1;
+}
+
+static void lexer_newline(Lexer *lx, size_t nl_pos) {
+  lx->line++;
+  lx->line_start = nl_pos + 1;
+}
+
+// Token whose lexeme is a copy of the first n bytes of lex, made in the
+// Lexer's arena.
+static Token make_token(Lexer *lx, TokenType type, const char *lex, size_t n,
+                        int line, int col) {
   Token t;
+  char *copy = arena_alloc(&lx->arena, n + 1);
+  memcpy(copy, lex, n);
+  copy[n] = '\0';
   t.type = type;
-  strncpy(t.lexeme, lex, MAX_LEXEME_LEN - 1);
-  t.lexeme[MAX_LEXEME_LEN - 1] = '\0';
+  t.lexeme = copy;
+  t.len = n;
   t.line = line;
   t.col = col;
   return t;
 }
 
-/* ---------- Skip whitespace and comments ---------- */
-static void skip_whitespace_and_comments(FILE *fp) {
-  while (1) {
-    int c = read_char(fp);
+static Token token_from_raw(Lexer *lx, const RawToken *r) {
+  const char *p = (const char *)lx->src + r->start;
+  size_t n = r->len;
 
-    // Skip whitespace
-    while (isspace(c)) {
-      c = read_char(fp);
-    }
+  switch ((TokenType)r->type) {
+  case TOK_EOF:
+    p = "EOF";
+    n = 3;
+    break;
+  case TOK_ERROR:
+    p = LEX_ERROR_MESSAGES[r->err];
+    n = strlen(p);
+    break;
+  case TOK_STRING:
+  case TOK_CHAR: // lexeme excludes the quotes
+    p++;
+    n -= 2;
+    break;
+  case TOK_IDENTIFIER: // enforce MAX_ID_LEN (keywords are short anyway)
+    if (n > MAX_ID_LEN)
+      n = MAX_ID_LEN;
+    break;
+  default:
+    break;
+  }
+  Token t = make_token(lx, (TokenType)r->type, p, n, r->line, r->col);
+  t.kind = (TokenKind)r->kind;
+  t.hash = r->hash;
+  t.sym = 0;
+  if (r->type == TOK_IDENTIFIER && lx->interner)
+    t.sym = intern(lx->interner, p, n, r->hash);
+  return t;
+}
 
-    // Check for comments
-    if (c == '/') {
-      int next = read_char(fp);
+/* ---------- Timing ---------- */
+static double now_seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (double)ts.tv_sec + (double)ts.tv_nsec * 1e-9;
+}
 
-      // Single-line comment //
-      if (next == '/') {
-        int ch = read_char(fp);
-        while (ch != '\n' && ch != EOF) {
-          ch = read_char(fp);
-        }
-        // Continue outer loop: might be more whitespace/comments
-        continue;
-      }
+/* ---------- Scanner ids ---------- */
+typedef enum {
+  SCAN_IDENT,
+  SCAN_NUMBER,
+  SCAN_STRING,
+  SCAN_CHAR,
+  SCAN_OPERATOR,
+  SCANNER_COUNT
+} ScannerId;
 
-      // Multi-line comment /* ... */
-      if (next == '*') {
-        int prev = 0;
-        int ch = read_char(fp);
+static const char *SCANNER_NAMES[SCANNER_COUNT] = {
+    "read_identifier_or_keyword", "read_number", "read_string",
+    "read_char_literal", "read_operator_or_separator"};
 
-        while (ch != EOF) {
-          if (prev == '*' && ch == '/') {
-            break;
-          }
-          prev = ch;
-          ch = read_char(fp);
-        }
+/* ---------- --stats instrumentation ---------- */
+#if LEXER_STATS
+struct LexStats {
+  unsigned long tokens[TOKEN_TYPE_COUNT];
+  unsigned long bytes_whitespace;
+  unsigned long bytes_comment;
+  unsigned long bytes_token;
+  unsigned long scanner_calls[SCANNER_COUNT];
+  double scanner_time[SCANNER_COUNT];
+  RawToken longest; // by source bytes, quotes included
+  // Scratch state between the STATS() hooks of one next_token() call.
+  size_t mark;
+  unsigned long comment_mark;
+  double scan_start;
+};
 
-        // If unterminated, we just stop at EOF (caller will hit EOF)
-        // Continue outer loop
-        continue;
-      }
+#define STATS(lx, stmt)                                                        \
+  do {                                                                         \
+    if ((lx)->stats) {                                                         \
+      stmt;                                                                    \
+    }                                                                          \
+  } while (0)
 
-      // Not a comment: put back both
-      unread_char(next, fp);
-      unread_char(c, fp);
-      return;
-    }
+static void stats_trivia_begin(Lexer *lx) {
+  lx->stats->mark = lx->pos;
+  lx->stats->comment_mark = lx->stats->bytes_comment;
+}
 
-    // Not whitespace/comment: put back and return
-    unread_char(c, fp);
-    return;
-  }
+static void stats_trivia_done(Lexer *lx) {
+  LexStats *st = lx->stats;
+  unsigned long comments = st->bytes_comment - st->comment_mark;
+  st->bytes_whitespace += (unsigned long)(lx->pos - st->mark) - comments;
+  st->mark = lx->pos;
+  st->scan_start = now_seconds();
 }
 
-/* ---------- Read identifier/keyword ---------- */
-static Token read_identifier_or_keyword(FILE *fp) {
-  int start_line = g_line;
-  int start_col = g_col + 1; // about to read first char
+static void stats_token_done(Lexer *lx, ScannerId scanner,
+                             const RawToken *t) {
+  LexStats *st = lx->stats;
+  st->scanner_time[scanner] += now_seconds() - st->scan_start;
+  st->scanner_calls[scanner]++;
+  st->tokens[t->type]++;
+  st->bytes_token += (unsigned long)t->len;
+  if (t->len > st->longest.len)
+    st->longest = *t;
+}
+#else
+#define STATS(lx, stmt)                                                        \
+  do {                                                                         \
+  } while (0)
+#endif
 
-  char buf[MAX_LEXEME_LEN];
-  int len = 0;
+/* ---------- Scanning kernels ---------- */
+// The inner loops that run over many bytes at a time: whitespace runs, block
+// comment bodies, identifier tails and string bodies. One LexEngine is picked
+// at startup (select_engine()) from the best tier the CPU supports, so a
+// single binary runs everywhere; --engine forces a tier. All tiers return
+// exactly the same positions and may read up to 64 bytes past the current
+// byte, which LEX_PAD covers. Most tokens and gaps are only a few bytes, where
+// a call costs more than it saves, so callers handle the first bytes inline
+// (up to KERNEL_MIN_RUN) and hand only longer runs to the kernel.
+#define KERNEL_MIN_RUN 8
 
-  int c = read_char(fp);
-  while (isalnum(c) || c == '_') {
-    if (len < MAX_LEXEME_LEN - 1) {
-      buf[len++] = (char)c;
-    }
-    c = read_char(fp);
+// Byte classes of one 64-byte block, bit i for byte i: the input of the
+// structural index.
+typedef struct {
+  uint64_t quote;
+  uint64_t backslash;
+  uint64_t apos;
+  uint64_t slash;
+  uint64_t star;
+  uint64_t space; // CH_SPACE
+  uint64_t nl;
+} BlockMasks;
+
+typedef struct {
+  const char *name;
+  int (*supported)(void);
+  // Skips CH_SPACE bytes from p, counting newlines; returns the first other
+  // byte's offset.
+  size_t (*skip_space)(Lexer *lx, size_t p);
+  // p is the first byte after "/*": returns the offset just past "*/", or
+  // lx->len if the comment is unterminated, counting newlines.
+  size_t (*comment_end)(Lexer *lx, size_t p);
+  // First byte at or after p that is not CH_IDENT.
+  size_t (*ident_end)(const unsigned char *s, size_t p);
+  // First '"', '\\', '\n' or NUL at or after p.
+  size_t (*string_stop)(const unsigned char *s, size_t p);
+  // Class masks of the 64 bytes at s.
+  void (*block_masks)(const unsigned char *s, BlockMasks *m);
+} LexEngine;
+
+static int engine_always(void) { return 1; }
+
+static size_t skip_space_scalar(Lexer *lx, size_t p) {
+  const unsigned char *s = lx->src;
+  while (CHAR_CLASS[s[p]] & CH_SPACE) {
+    if (s[p] == '\n')
+      lexer_newline(lx, p);
+    p++;
   }
-  buf[len] = '\0';
-  unread_char(c, fp);
+  return p;
+}
 
-  // Enforce MAX_ID_LEN for identifiers (keywords are short anyway)
-  if (!is_keyword(buf) && (int)strlen(buf) > MAX_ID_LEN) {
-    char truncated[MAX_LEXEME_LEN];
-    strncpy(truncated, buf, MAX_ID_LEN);
-    truncated[MAX_ID_LEN] = '\0';
-    return make_token(TOK_IDENTIFIER, truncated, start_line, start_col);
+static size_t comment_end_scalar(Lexer *lx, size_t p) {
+  const unsigned char *s = lx->src;
+  for (; p < lx->len; p++) {
+    if (s[p] == '\n')
+      lexer_newline(lx, p);
+    else if (s[p] == '*' && s[p + 1] == '/')
+      return p + 2;
   }
+  return lx->len;
+}
 
-  if (is_keyword(buf))
-    return make_token(TOK_KEYWORD, buf, start_line, start_col);
-  return make_token(TOK_IDENTIFIER, buf, start_line, start_col);
+static size_t ident_end_scalar(const unsigned char *s, size_t p) {
+  while (CHAR_CLASS[s[p]] & CH_IDENT)
+    p++;
+  return p;
 }
 
-/* ---------- Read number (int/float) ---------- */
-static Token read_number(FILE *fp) {
-  int start_line = g_line;
-  int start_col = g_col + 1;
+static inline int is_string_stop(unsigned char c) {
+  return c == '"' || c == '\\' || c == '\n' || c == '\0';
+}
 
-  char buf[MAX_LEXEME_LEN];
-  int len = 0;
-  int is_float = 0;
+static size_t string_stop_scalar(const unsigned char *s, size_t p) {
+  while (!is_string_stop(s[p]))
+    p++;
+  return p;
+}
 
-  int c = read_char(fp);
-  while (isdigit(c)) {
-    if (len < MAX_LEXEME_LEN - 1)
-      buf[len++] = (char)c;
-    c = read_char(fp);
+static void block_masks_scalar(const unsigned char *s, BlockMasks *m) {
+  memset(m, 0, sizeof(*m));
+  for (int i = 0; i < 64; i++) {
+    uint64_t bit = 1ULL << i;
+    switch (s[i]) {
+    case '"':
+      m->quote |= bit;
+      break;
+    case '\\':
+      m->backslash |= bit;
+      break;
+    case '\'':
+      m->apos |= bit;
+      break;
+    case '/':
+      m->slash |= bit;
+      break;
+    case '*':
+      m->star |= bit;
+      break;
+    case '\n':
+      m->nl |= bit;
+      m->space |= bit;
+      break;
+    default:
+      if (CHAR_CLASS[s[i]] & CH_SPACE)
+        m->space |= bit;
+      break;
+    }
   }
+}
 
-  if (c == '.') {
-    is_float = 1;
-    if (len < MAX_LEXEME_LEN - 1)
-      buf[len++] = '.';
-    c = read_char(fp);
-    while (isdigit(c)) {
-      if (len < MAX_LEXEME_LEN - 1)
-        buf[len++] = (char)c;
-      c = read_char(fp);
-    }
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define LEX_X86_KERNELS 1
+
+// Counts the newlines flagged in the low n bits of nl (block at base).
+static inline void lexer_newlines(Lexer *lx, size_t base, uint32_t nl,
+                                  unsigned n) {
+  if (n < 32)
+    nl &= (1u << n) - 1;
+  if (nl) {
+    lx->line += __builtin_popcount(nl);
+    lx->line_start = base + (31 - (unsigned)__builtin_clz(nl)) + 1;
   }
+}
 
-  buf[len] = '\0';
-  unread_char(c, fp);
+/* SSE4.2: PCMPESTRI matches byte sets and ranges, 16 bytes per step. */
+#define SSE42_TARGET __attribute__((target("sse4.2,popcnt")))
 
-  return make_token(is_float ? TOK_FLOAT : TOK_INT, buf, start_line, start_col);
+static int engine_sse42(void) {
+  return __builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt");
 }
 
-/* ---------- Read string literal ---------- */
-static Token read_string(FILE *fp) {
-  int start_line = g_line;
-  int start_col = g_col + 1;
-
-  char buf[MAX_LEXEME_LEN];
-  int len = 0;
-
-  int quote = read_char(fp); // should be '"'
-  (void)quote;
-
-  int c = read_char(fp);
-  while (c != EOF && c != '"') {
-    if (c == '\n') {
-      return make_token(TOK_ERROR, "Unterminated string literal", start_line,
-                        start_col);
-    }
-    if (c == '\\') { // escape sequence
-      if (len < MAX_LEXEME_LEN - 2)
-        buf[len++] = (char)c;
-      c = read_char(fp);
-      if (c == EOF)
-        return make_token(TOK_ERROR, "Unterminated string literal", start_line,
-                          start_col);
-      if (len < MAX_LEXEME_LEN - 2)
-        buf[len++] = (char)c;
-    } else {
-      if (len < MAX_LEXEME_LEN - 1)
-        buf[len++] = (char)c;
+SSE42_TARGET static size_t skip_space_sse42(Lexer *lx, size_t p) {
+  const __m128i set = _mm_setr_epi8(' ', '\t', '\n', '\v', '\f', '\r', 0, 0, 0,
+                                    0, 0, 0, 0, 0, 0, 0);
+  const __m128i nl = _mm_set1_epi8('\n');
+  while (1) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(lx->src + p));
+    unsigned i = (unsigned)_mm_cmpestri(
+        set, 6, v, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY | _SIDD_NEGATIVE_POLARITY);
+    lexer_newlines(lx, p, (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl)),
+                   i);
+    p += i;
+    if (i < 16)
+      return p;
+  }
+}
+
+SSE42_TARGET static size_t comment_end_sse42(Lexer *lx, size_t p) {
+  const __m128i star = _mm_set1_epi8('*'), slash = _mm_set1_epi8('/');
+  const __m128i nl = _mm_set1_epi8('\n');
+  for (; p < lx->len; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(lx->src + p));
+    __m128i next = _mm_loadu_si128((const __m128i *)(lx->src + p + 1));
+    uint32_t end = (uint32_t)_mm_movemask_epi8(_mm_and_si128(
+        _mm_cmpeq_epi8(v, star), _mm_cmpeq_epi8(next, slash)));
+    uint32_t nls = (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    if (end) {
+      unsigned i = (unsigned)__builtin_ctz(end);
+      lexer_newlines(lx, p, nls, i);
+      return p + i + 2;
     }
-    c = read_char(fp);
+    lexer_newlines(lx, p, nls, 16);
   }
+  return lx->len;
+}
 
-  if (c == EOF)
-    return make_token(TOK_ERROR, "Unterminated string literal", start_line,
-                      start_col);
-  buf[len] = '\0';
-  return make_token(TOK_STRING, buf, start_line, start_col);
+SSE42_TARGET static size_t ident_end_sse42(const unsigned char *s, size_t p) {
+  const __m128i ranges = _mm_setr_epi8('a', 'z', 'A', 'Z', '0', '9', '_', '_',
+                                       0, 0, 0, 0, 0, 0, 0, 0);
+  while (1) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + p));
+    unsigned i = (unsigned)_mm_cmpestri(
+        ranges, 8, v, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY);
+    p += i;
+    if (i < 16)
+      return p;
+  }
 }
 
-/* ---------- Read char literal ---------- */
-static Token read_char_literal(FILE *fp) {
-  int start_line = g_line;
-  int start_col = g_col + 1;
-
-  char buf[MAX_LEXEME_LEN];
-  int len = 0;
-
-  int quote = read_char(fp); // should be '\''
-  (void)quote;
-
-  int c = read_char(fp);
-  if (c == EOF || c == '\n') {
-    return make_token(TOK_ERROR, "Unterminated char literal", start_line,
-                      start_col);
-  }
-
-  if (c == '\\') { // escaped char like '\n'
-    if (len < MAX_LEXEME_LEN - 2)
-      buf[len++] = (char)c;
-    c = read_char(fp);
-    if (c == EOF || c == '\n')
-      return make_token(TOK_ERROR, "Unterminated char literal", start_line,
-                        start_col);
-    if (len < MAX_LEXEME_LEN - 2)
-      buf[len++] = (char)c;
-  } else {
-    if (len < MAX_LEXEME_LEN - 1)
-      buf[len++] = (char)c;
+SSE42_TARGET static size_t string_stop_sse42(const unsigned char *s,
+                                             size_t p) {
+  const __m128i set = _mm_setr_epi8('"', '\\', '\n', 0, 0, 0, 0, 0, 0, 0, 0,
+                                    0, 0, 0, 0, 0);
+  while (1) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + p));
+    unsigned i = (unsigned)_mm_cmpestri(set, 4, v, 16,
+                                        _SIDD_UBYTE_OPS | _SIDD_CMP_EQUAL_ANY);
+    p += i;
+    if (i < 16)
+      return p;
   }
+}
+
+// Bytes of v equal to c, as 16 mask bits.
+SSE42_TARGET static inline uint64_t sse_eq(__m128i v, char c) {
+  return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(v, _mm_set1_epi8(c)));
+}
 
-  int closing = read_char(fp);
-  if (closing != '\'') {
-    return make_token(TOK_ERROR, "Invalid/unterminated char literal",
-                      start_line, start_col);
+SSE42_TARGET static void block_masks_sse42(const unsigned char *s,
+                                           BlockMasks *m) {
+  memset(m, 0, sizeof(*m));
+  for (int k = 0; k < 64; k += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(s + k));
+    // '\t'..'\r': v - '\t' <= 4 unsigned, i.e. min(v - '\t', 4) == v - '\t'
+    __m128i d = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    uint64_t ctl = (uint32_t)_mm_movemask_epi8(
+        _mm_cmpeq_epi8(_mm_min_epu8(d, _mm_set1_epi8(4)), d));
+    m->quote |= sse_eq(v, '"') << k;
+    m->backslash |= sse_eq(v, '\\') << k;
+    m->apos |= sse_eq(v, '\'') << k;
+    m->slash |= sse_eq(v, '/') << k;
+    m->star |= sse_eq(v, '*') << k;
+    m->nl |= sse_eq(v, '\n') << k;
+    m->space |= (sse_eq(v, ' ') | ctl) << k;
   }
+}
 
-  buf[len] = '\0';
-  return make_token(TOK_CHAR, buf, start_line, start_col);
+/* AVX2: byte compares on 32-byte blocks, reduced to a bitmask. */
+#define AVX2_TARGET __attribute__((target("avx2,popcnt")))
+
+static int engine_avx2(void) {
+  return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt");
 }
 
-/* ---------- Operators & separators (handles multi-char) ---------- */
-static int is_separator_char(int c) {
-  return (c == '(' || c == ')' || c == '{' || c == '}' || c == '[' ||
-          c == ']' || c == ';' || c == ',');
+// Bytes in [lo, hi]. Signed compares suffice: bytes >= 0x80 are negative and
+// every range here is ASCII.
+AVX2_TARGET static inline __m256i avx2_in_range(__m256i v, char lo, char hi) {
+  __m256i above = _mm256_cmpgt_epi8(v, _mm256_set1_epi8((char)(lo - 1)));
+  __m256i below = _mm256_cmpgt_epi8(_mm256_set1_epi8((char)(hi + 1)), v);
+  return _mm256_and_si256(above, below);
 }
 
-static Token read_operator_or_separator(FILE *fp) {
-  int start_line = g_line;
-  int start_col = g_col + 1;
+AVX2_TARGET static size_t skip_space_avx2(Lexer *lx, size_t p) {
+  while (1) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(lx->src + p));
+    __m256i sp = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')),
+                                 avx2_in_range(v, '\t', '\r'));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(sp);
+    uint32_t nls = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    unsigned i = other ? (unsigned)__builtin_ctz(other) : 32;
+    lexer_newlines(lx, p, nls, i);
+    p += i;
+    if (i < 32)
+      return p;
+  }
+}
 
-  char lex[4] = {0};
-  int c1 = read_char(fp);
+AVX2_TARGET static size_t comment_end_avx2(Lexer *lx, size_t p) {
+  for (; p < lx->len; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(lx->src + p));
+    __m256i next = _mm256_loadu_si256((const __m256i *)(lx->src + p + 1));
+    uint32_t end = (uint32_t)_mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('*')),
+                         _mm256_cmpeq_epi8(next, _mm256_set1_epi8('/'))));
+    uint32_t nls = (uint32_t)_mm256_movemask_epi8(
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+    if (end) {
+      unsigned i = (unsigned)__builtin_ctz(end);
+      lexer_newlines(lx, p, nls, i);
+      return p + i + 2;
+    }
+    lexer_newlines(lx, p, nls, 32);
+  }
+  return lx->len;
+}
 
-  // Separators: single-char
-  if (is_separator_char(c1)) {
-    lex[0] = (char)c1;
-    lex[1] = '\0';
-    return make_token(TOK_SEPARATOR, lex, start_line, start_col);
+AVX2_TARGET static size_t ident_end_avx2(const unsigned char *s, size_t p) {
+  while (1) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + p));
+    __m256i lower = _mm256_or_si256(v, _mm256_set1_epi8(0x20));
+    __m256i id = _mm256_or_si256(
+        _mm256_or_si256(avx2_in_range(lower, 'a', 'z'),
+                        avx2_in_range(v, '0', '9')),
+        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+    uint32_t other = ~(uint32_t)_mm256_movemask_epi8(id);
+    if (other)
+      return p + (unsigned)__builtin_ctz(other);
+    p += 32;
   }
+}
 
-  // Try multi-char operators
-  int c2 = read_char(fp);
-  lex[0] = (char)c1;
-  lex[1] = (char)c2;
-  lex[2] = '\0';
+AVX2_TARGET static size_t string_stop_avx2(const unsigned char *s, size_t p) {
+  while (1) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(s + p));
+    __m256i stop = _mm256_or_si256(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                        _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\\'))),
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')),
+                        _mm256_cmpeq_epi8(v, _mm256_setzero_si256())));
+    uint32_t hit = (uint32_t)_mm256_movemask_epi8(stop);
+    if (hit)
+      return p + (unsigned)__builtin_ctz(hit);
+    p += 32;
+  }
+}
+
+// Both halves' byte masks as one 64-bit mask.
+AVX2_TARGET static inline uint64_t avx2_mask64(__m256i lo, __m256i hi) {
+  return (uint32_t)_mm256_movemask_epi8(lo) |
+         (uint64_t)(uint32_t)_mm256_movemask_epi8(hi) << 32;
+}
+
+AVX2_TARGET static inline uint64_t avx2_eq64(__m256i lo, __m256i hi, char c) {
+  __m256i cv = _mm256_set1_epi8(c);
+  return avx2_mask64(_mm256_cmpeq_epi8(lo, cv), _mm256_cmpeq_epi8(hi, cv));
+}
+
+AVX2_TARGET static void block_masks_avx2(const unsigned char *s,
+                                         BlockMasks *m) {
+  __m256i lo = _mm256_loadu_si256((const __m256i *)s);
+  __m256i hi = _mm256_loadu_si256((const __m256i *)(s + 32));
+  m->quote = avx2_eq64(lo, hi, '"');
+  m->backslash = avx2_eq64(lo, hi, '\\');
+  m->apos = avx2_eq64(lo, hi, '\'');
+  m->slash = avx2_eq64(lo, hi, '/');
+  m->star = avx2_eq64(lo, hi, '*');
+  m->nl = avx2_eq64(lo, hi, '\n');
+  m->space = avx2_eq64(lo, hi, ' ') |
+             avx2_mask64(avx2_in_range(lo, '\t', '\r'),
+                         avx2_in_range(hi, '\t', '\r'));
+}
+#endif
+
+// Best tier first; select_engine() takes the first one the CPU supports.
+static const LexEngine ENGINES[] = {
+#ifdef LEX_X86_KERNELS
+    {"avx2", engine_avx2, skip_space_avx2, comment_end_avx2, ident_end_avx2,
+     string_stop_avx2, block_masks_avx2},
+    {"sse42", engine_sse42, skip_space_sse42, comment_end_sse42,
+     ident_end_sse42, string_stop_sse42, block_masks_sse42},
+#endif
+    {"scalar", engine_always, skip_space_scalar, comment_end_scalar,
+     ident_end_scalar, string_stop_scalar, block_masks_scalar}};
+static const int ENGINE_COUNT = (int)(sizeof(ENGINES) / sizeof(ENGINES[0]));
 
-  // List of common 2-char operators
-  const char *two_ops[] = {"==", "!=", "<=", ">=", "&&", "||", "++",
-                           "--", "+=", "-=", "*=", "/=", "%=", "->"};
-  int two_ops_count = (int)(sizeof(two_ops) / sizeof(two_ops[0]));
+// Set once by select_engine() before any lexing (and any thread) starts.
+static const LexEngine *lex_engine = &ENGINES[ENGINE_COUNT - 1];
+static int lex_use_index; // --engine=index, see lexer_build_index()
 
-  for (int i = 0; i < two_ops_count; i++) {
-    if (strcmp(lex, two_ops[i]) == 0) {
-      return make_token(TOK_OPERATOR, lex, start_line, start_col);
+// name is an ENGINES name, NULL/"auto" for the best supported tier, or
+// "index" for the structural index on top of that tier. Returns 0 (after
+// saying why) if it is unknown or this CPU lacks it.
+static int select_engine(const char *name) {
+#ifdef LEX_X86_KERNELS
+  __builtin_cpu_init();
+#endif
+  if (name && strcmp(name, "index") == 0) {
+    lex_use_index = 1;
+    name = NULL;
+  }
+  int want_auto = !name || strcmp(name, "auto") == 0;
+  for (int i = 0; i < ENGINE_COUNT; i++) {
+    if (!want_auto && strcmp(name, ENGINES[i].name) != 0)
+      continue;
+    if (ENGINES[i].supported()) {
+      lex_engine = &ENGINES[i];
+      return 1;
+    }
+    if (!want_auto) {
+      fprintf(stderr, "Engine %s is not supported by this CPU\n", name);
+      return 0;
     }
   }
+  if (want_auto)
+    return 1; // scalar always qualifies
+  fprintf(stderr, "Unknown engine: %s (expected auto, index", name);
+  for (int i = 0; i < ENGINE_COUNT; i++)
+    fprintf(stderr, ", %s", ENGINES[i].name);
+  fprintf(stderr, ")\n");
+  return 0;
+}
+
+static const char *engine_name(void) {
+  return lex_use_index ? "index" : lex_engine->name;
+}
+
+/* ---------- Skip whitespace and comments ---------- */
+static void skip_whitespace_and_comments(Lexer *lx) {
+  const unsigned char *s = lx->src;
+  size_t p = lx->pos;
 
-  // Not a 2-char operator => unread c2 and treat c1 as single operator/unknown
-  unread_char(c2, fp);
+  while (1) {
+    // Skip whitespace: a single separator inline, longer runs (newline plus
+    // indentation) in the kernel
+    if (CHAR_CLASS[s[p]] & CH_SPACE) {
+      if (s[p] == '\n')
+        lexer_newline(lx, p);
+      p++;
+      if (CHAR_CLASS[s[p]] & CH_SPACE)
+        p = lex_engine->skip_space(lx, p);
+    }
 
-  lex[0] = (char)c1;
-  lex[1] = '\0';
+    // Check for comments; a lone '/' is left for the operator scanner, and
+    // so are comments when they are wanted as tokens
+    if (s[p] != '/' || (s[p + 1] != '/' && s[p + 1] != '*'))
+      break;
+    if (lx->type_mask & (1u << TOK_COMMENT))
+      break;
 
-  // Single-char operators set (extend as needed)
-  if (strchr("+-*/%<>=!&|^~?:.", c1)) {
-    return make_token(TOK_OPERATOR, lex, start_line, start_col);
+#if LEXER_STATS
+    size_t start = p;
+#endif
+    if (s[p + 1] == '/') {
+      // Single-line comment: stop at the newline, the loop above counts it
+      const unsigned char *nl = memchr(s + p + 2, '\n', lx->len - (p + 2));
+      p = nl ? (size_t)(nl - s) : lx->len;
+    } else {
+      // Multi-line comment /* ... */ (if unterminated we stop at EOF)
+      p = lex_engine->comment_end(lx, p + 2);
+    }
+    STATS(lx, lx->stats->bytes_comment += (unsigned long)(p - start));
   }
+  lx->pos = p;
+}
+
+/* ---------- Structural index (--engine=index) ---------- */
+// Two stages instead of tracking string and comment state byte by byte.
+// Stage 1 classifies the whole input 64 bytes at a time into three bitmaps:
+// bytes that are not whitespace or comment ("code"), the unescaped quotes and
+// newlines that can end a string ("stop"), and newlines. Escapes come from
+// the odd-length backslash runs and the inside-string regions from a prefix
+// XOR of the unescaped quotes, as in simdjson. Stage 2, in next_raw_token()
+// and read_string(), jumps to the next code byte, takes line numbers from
+// newline popcounts and ends strings at the next stop bit; the scanners only
+// run over the tokens themselves.
+//
+// The quote parity alone is only right when every apostrophe, backslash and
+// comment opener in the block is inside a string and no string runs into a
+// newline. Other blocks are classified exactly by walking their quote,
+// comment and newline bits in order, so the tokens are the same as with any
+// other engine.
+struct LexIndex {
+  uint64_t *code;
+  uint64_t *stop;
+  uint64_t *nl;
+  size_t counted; // newlines before this offset are in line/line_start
+  int line;
+  size_t line_start;
+};
+
+typedef enum {
+  IDX_CODE,
+  IDX_STRING,
+  IDX_LINE_COMMENT,
+  IDX_BLOCK_COMMENT
+} IndexMode;
+
+typedef struct {
+  IndexMode mode;
+  uint64_t escaped; // IDX_STRING: the next byte is escaped (0 or 1)
+  size_t resume;    // first byte not yet classified
+} IndexState;
 
-  return make_token(TOK_UNKNOWN, lex, start_line, start_col);
+static inline int bit_ctz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_ctzll(x);
+#else
+  int n = 0;
+  for (; !(x & 1); x >>= 1)
+    n++;
+  return n;
+#endif
 }
 
-/* ---------- Get next token ---------- */
-static Token next_token(FILE *fp) {
-  skip_whitespace_and_comments(fp);
+static inline int bit_clz64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_clzll(x);
+#else
+  int n = 0;
+  for (; !(x >> 63); x <<= 1)
+    n++;
+  return n;
+#endif
+}
 
-  int c = read_char(fp);
-  if (c == EOF)
-    return make_token(TOK_EOF, "EOF", g_line, g_col);
+static inline int bit_popcount64(uint64_t x) {
+#ifdef __GNUC__
+  return __builtin_popcountll(x);
+#else
+  int n = 0;
+  for (; x; x &= x - 1)
+    n++;
+  return n;
+#endif
+}
 
-  unread_char(c, fp);
+// Bit i of the result: odd number of set bits in x's bits 0..i.
+static inline uint64_t prefix_xor(uint64_t x) {
+  x ^= x << 1;
+  x ^= x << 2;
+  x ^= x << 4;
+  x ^= x << 8;
+  x ^= x << 16;
+  x ^= x << 32;
+  return x;
+}
 
-  // Decide token type by first char
-  c = read_char(fp);
-  unread_char(c, fp);
+// Bytes escaped by an odd-length backslash run. *carry is 1 when the
+// previous block ended in such a run, and is set for the next block.
+static uint64_t odd_backslash_ends(uint64_t bs, uint64_t *carry) {
+  const uint64_t even_bits = 0x5555555555555555ULL;
+  uint64_t start_edges = bs & ~(bs << 1);
+  uint64_t even_start_mask = even_bits ^ *carry;
+  uint64_t even_starts = start_edges & even_start_mask;
+  uint64_t odd_starts = start_edges & ~even_start_mask;
+  uint64_t even_carries = bs + even_starts;
+  uint64_t odd_carries = bs + odd_starts;
+  uint64_t ends_odd = odd_carries < bs; // carried out of bit 63
+  odd_carries |= *carry;
+  *carry = ends_odd;
+  uint64_t even_carry_ends = even_carries & ~bs;
+  uint64_t odd_carry_ends = odd_carries & ~bs;
+  return (even_carry_ends & ~even_bits) | (odd_carry_ends & even_bits);
+}
 
-  if (isalpha(c) || c == '_') {
-    return read_identifier_or_keyword(fp);
-  }
-  if (isdigit(c)) {
-    return read_number(fp);
-  }
-  if (c == '"') {
-    return read_string(fp);
-  }
-  if (c == '\'') {
-    return read_char_literal(fp);
-  }
+// Bits [a, b) of a word, 0 <= a < 64, a <= b.
+static inline uint64_t bit_range(unsigned a, unsigned b) {
+  uint64_t below_b = b >= 64 ? ~0ULL : (1ULL << b) - 1;
+  return below_b & ~0ULL << a;
+}
 
-  // Comments are already skipped, so here / is operator
-  return read_operator_or_separator(fp);
+// First set bit of m at or after k (k < 64), or 64.
+static inline unsigned bit_next(uint64_t m, unsigned k) {
+  m &= ~0ULL << k;
+  return m ? (unsigned)bit_ctz64(m) : 64;
 }
 
-/* ---------- Token printing ---------- */
-static const char *token_name(TokenType t) {
-  switch (t) {
-  case TOK_EOF:
-    return "EOF";
-  case TOK_KEYWORD:
-    return "KEYWORD";
-  case TOK_IDENTIFIER:
-    return "IDENTIFIER";
-  case TOK_INT:
-    return "INT";
-  case TOK_FLOAT:
-    return "FLOAT";
-  case TOK_STRING:
-    return "STRING";
-  case TOK_CHAR:
-    return "CHAR";
-  case TOK_OPERATOR:
-    return "OPERATOR";
-  case TOK_SEPARATOR:
-    return "SEPARATOR";
-  case TOK_UNKNOWN:
-    return "UNKNOWN";
-  case TOK_ERROR:
-    return "ERROR";
-  default:
-    return "???";
+// Exact classification of the block at base from st->resume on, walking the
+// quote, comment and newline bits in order rather than the bytes. May end a
+// few bytes into the next block (after a char literal or comment opener),
+// which then starts at the new st->resume.
+static void index_block_events(const Lexer *lx, LexIndex *ix, IndexState *st,
+                               size_t base, const BlockMasks *m,
+                               uint64_t next_slash, uint64_t next_star) {
+  const unsigned char *s = lx->src;
+  uint64_t openers = m->slash & (next_slash | next_star);
+  uint64_t comment_ends = m->star & next_slash;
+  uint64_t code = 0, stop = 0;
+  unsigned k = st->resume > base ? (unsigned)(st->resume - base) : 0;
+  if (st->mode == IDX_STRING && st->escaped && k == 0) {
+    code |= 1;
+    k = 1;
+  }
+  st->escaped = 0;
+
+  while (k < 64) {
+    unsigned e;
+    switch (st->mode) {
+    case IDX_CODE:
+      e = bit_next(m->quote | m->apos | openers, k);
+      code |= bit_range(k, e) & ~m->space;
+      if (e == 64) {
+        k = 64;
+      } else if (openers >> e & 1) {
+        st->mode = s[base + e + 1] == '/' ? IDX_LINE_COMMENT : IDX_BLOCK_COMMENT;
+        k = e + 2;
+      } else if (s[base + e] == '"') {
+        code |= 1ULL << e;
+        st->mode = IDX_STRING;
+        k = e + 1;
+      } else { // same extent as read_char_literal()
+        code |= 1ULL << e;
+        const unsigned char *c = s + base + e + 1;
+        if (*c == '\\')
+          c++;
+        if (c[0] != '\n' && c[1] == '\'')
+          c += 2;
+        k = (unsigned)(c - (s + base));
+      }
+      break;
+    case IDX_STRING:
+      e = bit_next(m->quote | m->nl | m->backslash, k);
+      code |= bit_range(k, e);
+      if (e == 64) {
+        k = 64;
+      } else if (m->backslash >> e & 1) { // keep the escaped byte too
+        code |= 1ULL << e;
+        if (e == 63)
+          st->escaped = 1;
+        k = e + 2;
+      } else {
+        code |= 1ULL << e;
+        stop |= 1ULL << e;
+        st->mode = IDX_CODE;
+        k = e + 1;
+      }
+      break;
+    case IDX_LINE_COMMENT:
+      e = bit_next(m->nl, k);
+      if (e < 64)
+        st->mode = IDX_CODE; // the newline itself is whitespace
+      k = e;
+      break;
+    case IDX_BLOCK_COMMENT:
+      e = bit_next(comment_ends, k);
+      if (e < 64) {
+        st->mode = IDX_CODE;
+        k = e + 2;
+      } else {
+        k = 64;
+      }
+      break;
+    }
   }
+  size_t w = base >> 6;
+  ix->code[w] = code;
+  ix->stop[w] = stop;
+  st->resume = base + k;
+  if (st->escaped)
+    st->resume = base + 64; // the escape is carried instead
 }
 
-int main(int argc, char **argv) {
-  FILE *fp = NULL;
+static void index_block(const Lexer *lx, LexIndex *ix, IndexState *st,
+                        size_t base) {
+  const unsigned char *s = lx->src;
+  size_t w = base >> 6;
+  BlockMasks m;
+  lex_engine->block_masks(s + base, &m);
+  ix->nl[w] = m.nl;
+  // Bit i: byte i + 1 is a '/' or '*' (bit 63 looks into the next block)
+  uint64_t next_slash = m.slash >> 1 | (uint64_t)(s[base + 64] == '/') << 63;
+  uint64_t next_star = m.star >> 1 | (uint64_t)(s[base + 64] == '*') << 63;
 
-  if (argc < 2) {
-    printf("Usage: %s <source_file>\n", argv[0]);
-    printf("Example: %s test.txt\n", argv[0]);
-    return 1;
+  // Strings only: the quote parity gives the whole block at once
+  if (st->resume == base && (st->mode == IDX_CODE || st->mode == IDX_STRING)) {
+    uint64_t carry = st->escaped;
+    uint64_t escaped = odd_backslash_ends(m.backslash, &carry);
+    uint64_t in_string = prefix_xor(m.quote & ~escaped);
+    if (st->mode == IDX_STRING)
+      in_string = ~in_string;
+    uint64_t outside = ~in_string;
+    uint64_t openers = m.slash & (next_slash | next_star);
+    uint64_t unclosed = m.nl & in_string & ~escaped;
+    if (!((m.backslash | m.apos | openers) & outside) && !unclosed) {
+      ix->code[w] = ~(m.space & outside);
+      ix->stop[w] = (m.quote | m.nl) & ~escaped;
+      st->mode = in_string >> 63 ? IDX_STRING : IDX_CODE;
+      st->escaped = carry;
+      st->resume = base + 64;
+      return;
+    }
   }
+  index_block_events(lx, ix, st, base, &m, next_slash, next_star);
+}
 
-  fp = fopen(argv[1], "r");
-  if (!fp) {
-    perror("fopen");
-    return 1;
-  }
+// Stage 1 over all of lx->src. The bitmaps live in the Lexer's arena, so
+// they go away with the lexemes at the next lexer_reset().
+static void lexer_build_index(Lexer *lx) {
+  // Every block writes its own word of each bitmap, so no clearing needed
+  size_t words = (lx->len + 63) / 64;
+  LexIndex *ix = arena_alloc(&lx->arena, sizeof(LexIndex));
+  uint64_t *bits = arena_alloc(&lx->arena, 3 * words * sizeof(uint64_t));
+  ix->code = bits;
+  ix->stop = bits + words;
+  ix->nl = bits + 2 * words;
+  ix->counted = 0;
+  ix->line = 1;
+  ix->line_start = 0;
 
-  printf("Lexical Analysis Output:\n");
-  printf("------------------------\n");
+  IndexState st = {IDX_CODE, 0, 0};
+  for (size_t base = 0; base < lx->len; base += 64)
+    index_block(lx, ix, &st, base);
+  lx->index = ix;
+}
 
-  while (1) {
-    Token t = next_token(fp);
-    printf("[%d:%d] %-10s  \"%s\"\n", t.line, t.col, token_name(t.type),
-           t.lexeme);
+// First set bit at or after from, or len if there is none before len.
+static size_t bitmap_next(const uint64_t *bm, size_t from, size_t len) {
+  if (from >= len)
+    return len;
+  size_t w = from >> 6;
+  uint64_t word = bm[w] & ~0ULL << (from & 63);
+  while (!word) {
+    if (++w << 6 >= len)
+      return len;
+    word = bm[w];
+  }
+  size_t p = (w << 6) + (size_t)bit_ctz64(word);
+  return p < len ? p : len;
+}
 
-    if (t.type == TOK_ERROR) {
-      printf("Stopping due to error.\n");
-      break;
+// Stage 2's replacement for skip_whitespace_and_comments(): jump to the next
+// code byte and bring line/line_start up to it from the newline bitmap. The
+// index keeps its own count, so newlines a scanner already counted (escaped
+// ones in strings) are not counted twice.
+static void index_skip_trivia(Lexer *lx) {
+  LexIndex *ix = lx->index;
+  size_t p = bitmap_next(ix->code, lx->pos, lx->len);
+  for (size_t a = ix->counted; a < p;) {
+    size_t w = a >> 6, next = (w + 1) << 6;
+    uint64_t m = ix->nl[w] & ~0ULL << (a & 63);
+    if (p < next)
+      m &= (1ULL << (p & 63)) - 1;
+    if (m) {
+      ix->line += bit_popcount64(m);
+      ix->line_start = (w << 6) + (size_t)(64 - bit_clz64(m));
     }
-    if (t.type == TOK_EOF)
-      break;
+    a = next;
   }
+  if (p > ix->counted)
+    ix->counted = p;
+  lx->line = ix->line;
+  lx->line_start = ix->line_start;
+  lx->pos = p;
+}
 
-  fclose(fp);
+/* ---------- Read identifier/keyword ---------- */
+// Scanners start at lx->pos, which next_raw_token() has already recorded as
+// the token start, and advance lx->pos past the token. They only classify:
+// nothing is copied until a Token is materialized.
+static void read_identifier_or_keyword(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t start = lx->pos;
+  size_t p = start + 1;
+
+  while (CHAR_CLASS[s[p]] & CH_IDENT) {
+    if (++p - start == KERNEL_MIN_RUN) {
+      p = lex_engine->ident_end(s, p);
+      break;
+    }
+  }
+  lx->pos = p;
+  // Hashed while the bytes are still in L1, over the MAX_ID_LEN bytes a
+  // Token keeps.
+  t->hash = lex_hash64(s + start, p - start < MAX_ID_LEN ? p - start
+                                                         : MAX_ID_LEN);
+  t->kind = (unsigned char)keyword_kind(s + start, p - start);
+  t->type = t->kind ? TOK_KEYWORD : TOK_IDENTIFIER;
+}
+
+/* ---------- Read number (int/float) ---------- */
+static void read_number(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t p = lx->pos + 1;
+
+  while (CHAR_CLASS[s[p]] & CH_DIGIT)
+    p++;
+  t->type = TOK_INT;
+
+  if (s[p] == '.') {
+    t->type = TOK_FLOAT;
+    p++;
+    while (CHAR_CLASS[s[p]] & CH_DIGIT)
+      p++;
+  }
+  lx->pos = p;
+}
+
+/* ---------- Read string literal ---------- */
+static void read_string(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t start = lx->pos + 1; // skip opening '"'
+  size_t p = start;
+
+  if (lx->index) { // the string ends at the next stop bit
+    size_t q = bitmap_next(lx->index->stop, p, lx->len);
+    if (q < lx->len && s[q] == '"') {
+      lx->pos = q + 1;
+      t->type = TOK_STRING;
+      t->hash = lex_hash64(s + start, q - start);
+      return;
+    }
+    // an unterminated string: the loop below finds where it stops
+  }
+
+  while (1) {
+    size_t run = p + KERNEL_MIN_RUN;
+    while (p < run && !is_string_stop(s[p]))
+      p++;
+    if (p == run)
+      p = lex_engine->string_stop(s, p);
+    unsigned char c = s[p];
+    if (c == '"')
+      break;
+    if (c == '\\') { // escape sequence: keep both bytes as written
+      if (p + 1 >= lx->len)
+        break;
+      if (s[p + 1] == '\n')
+        lexer_newline(lx, p + 1);
+      p += 2;
+      continue;
+    }
+    if (c == '\n' || p >= lx->len)
+      break;
+    p++;
+  }
+
+  if (s[p] != '"') {
+    lx->pos = p;
+    t->type = TOK_ERROR;
+    t->err = LEX_ERR_STRING;
+    return;
+  }
+  lx->pos = p + 1;
+  t->type = TOK_STRING;
+  t->hash = lex_hash64(s + start, p - start); // the bytes just scanned
+}
+
+/* ---------- Read char literal ---------- */
+static void read_char_literal(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t p = lx->pos + 1; // skip opening '\''
+
+  if (s[p] == '\\') // escaped char like '\n'
+    p++;
+  if (s[p] == '\n' || p >= lx->len) {
+    lx->pos = p;
+    t->type = TOK_ERROR;
+    t->err = LEX_ERR_CHAR;
+    return;
+  }
+  p++;
+
+  if (s[p] != '\'') {
+    lx->pos = p;
+    t->type = TOK_ERROR;
+    t->err = LEX_ERR_CHAR_INVALID;
+    return;
+  }
+  lx->pos = p + 1;
+  t->type = TOK_CHAR;
+}
+
+/* ---------- Read comment (--comments) ---------- */
+// Only reached when TOK_COMMENT is in the type mask; otherwise comments are
+// skipped as trivia. The token is the whole comment, delimiters included,
+// and its kind tells doc comments ("///", "/**", but not "////" or "/**/")
+// from plain ones. Both ends are found by the same vectorized searches as
+// when skipping.
+static void read_comment(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t start = lx->pos;
+  t->type = TOK_COMMENT;
+  if (s[start + 1] == '/') {
+    const unsigned char *nl =
+        memchr(s + start + 2, '\n', lx->len - (start + 2));
+    lx->pos = nl ? (size_t)(nl - s) : lx->len;
+    t->kind = s[start + 2] == '/' && s[start + 3] != '/' ? CMT_DOC : CMT_LINE;
+  } else { // unterminated: runs to EOF, as when skipping
+    lx->pos = lex_engine->comment_end(lx, start + 2);
+    t->kind = s[start + 2] == '*' && s[start + 3] != '/' ? CMT_DOC : CMT_BLOCK;
+  }
+}
+
+/* ---------- Operators & separators (handles multi-char) ---------- */
+// Kinds by byte. Every two-byte operator is an operator byte followed by
+// '=', the same byte again, or "->", so three lookups cover them all.
+static const unsigned char PUNCT_KIND[256] = {
+    ['+'] = OP_PLUS,      ['-'] = OP_MINUS,     ['*'] = OP_STAR,
+    ['/'] = OP_SLASH,     ['%'] = OP_PERCENT,   ['<'] = OP_LT,
+    ['>'] = OP_GT,        ['='] = OP_ASSIGN,    ['!'] = OP_NOT,
+    ['&'] = OP_AMP,       ['|'] = OP_PIPE,      ['^'] = OP_CARET,
+    ['~'] = OP_TILDE,     ['?'] = OP_QUESTION,  [':'] = OP_COLON,
+    ['.'] = OP_DOT,       ['('] = SEP_LPAREN,   [')'] = SEP_RPAREN,
+    ['{'] = SEP_LBRACE,   ['}'] = SEP_RBRACE,   ['['] = SEP_LBRACKET,
+    [']'] = SEP_RBRACKET, [';'] = SEP_SEMI,     [','] = SEP_COMMA};
+static const unsigned char OP_WITH_EQ_KIND[256] = {
+    ['='] = OP_EQ,         ['!'] = OP_NE,         ['<'] = OP_LE,
+    ['>'] = OP_GE,         ['+'] = OP_ADD_ASSIGN, ['-'] = OP_SUB_ASSIGN,
+    ['*'] = OP_MUL_ASSIGN, ['/'] = OP_DIV_ASSIGN, ['%'] = OP_MOD_ASSIGN};
+static const unsigned char OP_DOUBLED_KIND[256] = {
+    ['&'] = OP_AND, ['|'] = OP_OR, ['+'] = OP_INC, ['-'] = OP_DEC};
+
+// Kind of the two-byte operator c1 c2, or KIND_NONE.
+static unsigned char operator_pair_kind(unsigned char c1, unsigned char c2) {
+  return c2 == '='                ? OP_WITH_EQ_KIND[c1]
+         : c2 == c1               ? OP_DOUBLED_KIND[c1]
+         : c1 == '-' && c2 == '>' ? OP_ARROW
+                                  : KIND_NONE;
+}
+
+static void read_operator_or_separator(Lexer *lx, RawToken *t) {
+  const unsigned char *s = lx->src;
+  size_t start = lx->pos;
+  unsigned char c1 = s[start];
+  unsigned char c2 = s[start + 1]; // the padding makes this safe at EOF
+
+  if (c1 == '/' && (c2 == '/' || c2 == '*')) {
+    read_comment(lx, t);
+    return;
+  }
+
+  // Separators: single-char
+  if (CHAR_CLASS[c1] & CH_SEP) {
+    lx->pos = start + 1;
+    t->type = TOK_SEPARATOR;
+    t->kind = PUNCT_KIND[c1];
+    return;
+  }
+
+  // Try multi-char operators
+  unsigned char pair = operator_pair_kind(c1, c2);
+  if (pair) {
+    lx->pos = start + 2;
+    t->type = TOK_OPERATOR;
+    t->kind = pair;
+    return;
+  }
+
+  // Not a 2-char operator => c1 alone is an operator or unknown
+  lx->pos = start + 1;
+  t->type = (CHAR_CLASS[c1] & CH_OP) ? TOK_OPERATOR : TOK_UNKNOWN;
+  t->kind = PUNCT_KIND[c1];
+}
+
+/* ---------- Get next token ---------- */
+typedef void (*ScannerFn)(Lexer *lx, RawToken *t);
+
+static const ScannerFn SCANNERS[SCANNER_COUNT] = {
+    read_identifier_or_keyword, read_number, read_string, read_char_literal,
+    read_operator_or_separator};
+
+// First byte of a token -> ScannerId. Comments are already skipped, so '/'
+// lands on the operator scanner.
+_Static_assert(SCAN_IDENT == 0 && SCAN_NUMBER == 1 && SCAN_STRING == 2 &&
+                   SCAN_CHAR == 3 && SCAN_OPERATOR == 4,
+               "FIRST_BYTE_SCANNER uses raw ScannerId values");
+static const unsigned char FIRST_BYTE_SCANNER[256] = {
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0x00
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0x10
+    4, 4, 2, 4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, // 0x20
+    1, 1, 1, 1, 1, 1, 1, 1, 1, 1, 4, 4, 4, 4, 4, 4, // 0x30
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x40
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 4, 4, 0, // 0x50
+    4, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, // 0x60
+    0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 4, 4, 4, 4, 4, // 0x70
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0x80
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0x90
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xa0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xb0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xc0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xd0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xe0
+    4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0xf0
+};
+
+static void next_raw_token(Lexer *lx, RawToken *t) {
+  STATS(lx, stats_trivia_begin(lx));
+  if (lx->index)
+    index_skip_trivia(lx);
+  else
+    skip_whitespace_and_comments(lx);
+  STATS(lx, stats_trivia_done(lx));
+
+  t->start = lx->pos;
+  t->line = lx->line;
+  t->err = LEX_ERR_NONE;
+  t->kind = KIND_NONE;
+  t->hash = 0;
+  if (lx->pos >= lx->len) {
+    STATS(lx, lx->stats->tokens[TOK_EOF]++);
+    t->type = TOK_EOF;
+    t->len = 0;
+    t->col = (int)(lx->len - lx->line_start);
+    return;
+  }
+  t->col = lexer_col(lx, lx->pos);
+
+  // One table lookup and one indirect call pick the scanner; the first byte
+  // is only peeked, each scanner starts at lx->pos itself.
+  ScannerId scanner = (ScannerId)FIRST_BYTE_SCANNER[lx->src[lx->pos]];
+  SCANNERS[scanner](lx, t);
+  t->len = lx->pos - t->start;
+  STATS(lx, stats_token_done(lx, scanner, t));
+}
+
+// Like next_raw_token(), but skips token types outside lx->type_mask. Those
+// are recognized (the input has to be consumed) but never materialized.
+static void next_wanted_raw_token(Lexer *lx, RawToken *t) {
+  do {
+    next_raw_token(lx, t);
+  } while (!((lx->type_mask >> t->type) & 1u));
+}
+
+static Token next_token(Lexer *lx) {
+  RawToken r;
+  next_wanted_raw_token(lx, &r);
+  return token_from_raw(lx, &r);
+}
+
+/* ---------- Lookahead ---------- */
+// A window over the upcoming tokens for recursive-descent consumers:
+// lookahead_peek() looks k tokens ahead without consuming anything, and
+// lookahead_mark()/lookahead_reset() backtrack without scanning the input
+// again. Tokens stay raw (no lexeme copies) in a ring indexed by absolute
+// token number, which only grows when a mark or a deep peek holds on to more
+// tokens than it has room for.
+#define LOOKAHEAD_MIN_CAP 8 // a power of two
+
+typedef struct {
+  Lexer *lx;
+  RawToken *ring;
+  size_t cap;    // a power of two
+  size_t head;   // number of the current token
+  size_t filled; // tokens lexed so far
+  size_t pin;    // oldest token an outstanding mark can return to
+  int marks;     // outstanding marks
+  int done;      // EOF or an error was lexed, nothing follows it
+} Lookahead;
+
+typedef size_t LookaheadMark;
+
+static void lookahead_init(Lookahead *la, Lexer *lx) {
+  memset(la, 0, sizeof(*la));
+  la->lx = lx;
+  la->cap = LOOKAHEAD_MIN_CAP;
+  la->ring = malloc(la->cap * sizeof(RawToken));
+  if (!la->ring) {
+    perror("malloc");
+    exit(1);
+  }
+}
+
+static void lookahead_free(Lookahead *la) {
+  free(la->ring);
+  la->ring = NULL;
+}
+
+// Doubles the ring, moving tokens [keep, filled) to their new slots.
+static void lookahead_grow(Lookahead *la, size_t keep) {
+  size_t cap = la->cap * 2;
+  RawToken *ring = malloc(cap * sizeof(RawToken));
+  if (!ring) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t i = keep; i < la->filled; i++)
+    ring[i & (cap - 1)] = la->ring[i & (la->cap - 1)];
+  free(la->ring);
+  la->ring = ring;
+  la->cap = cap;
+}
+
+// The token k places after the current one (k = 0 is the current token),
+// lexing only as far as needed. Past EOF or an error that token repeats.
+// The pointer is valid until the next lookahead call.
+static const RawToken *lookahead_peek(Lookahead *la, size_t k) {
+  size_t want = la->head + k;
+  while (la->filled <= want && !la->done) {
+    size_t keep = la->marks ? la->pin : la->head;
+    if (la->filled - keep == la->cap)
+      lookahead_grow(la, keep);
+    RawToken *t = &la->ring[la->filled & (la->cap - 1)];
+    next_wanted_raw_token(la->lx, t);
+    la->filled++;
+    la->done = t->type == TOK_EOF || t->type == TOK_ERROR;
+  }
+  if (want >= la->filled)
+    want = la->filled - 1;
+  return &la->ring[want & (la->cap - 1)];
+}
+
+// Consumes the current token; EOF and errors are never consumed.
+static void lookahead_advance(Lookahead *la) {
+  const RawToken *t = lookahead_peek(la, 0);
+  if (t->type != TOK_EOF && t->type != TOK_ERROR)
+    la->head++;
+}
+
+// Remembers the current position for lookahead_reset(). Marks nest: each
+// one is dropped with lookahead_release(), innermost first.
+static LookaheadMark lookahead_mark(Lookahead *la) {
+  if (la->marks++ == 0)
+    la->pin = la->head;
+  return la->head;
+}
+
+static void lookahead_reset(Lookahead *la, LookaheadMark m) { la->head = m; }
+
+static void lookahead_release(Lookahead *la) { la->marks--; }
+
+/* ---------- Trivia (--trivia) ---------- */
+// Lossless lexing for formatters. The whitespace and comments that
+// skip_whitespace_and_comments() drops are kept as spans of the source
+// (nothing is copied) and attached to the tokens around them: a token's
+// trailing trivia runs up to and including the end of its line, the rest
+// leads the next token, and whatever precedes EOF leads the EOF token.
+// Writing out each token's leading trivia, its bytes and its trailing
+// trivia gives back the input exactly.
+typedef enum {
+  TRIVIA_SPACE,
+  TRIVIA_LINE_COMMENT,
+  TRIVIA_BLOCK_COMMENT
+} TriviaKind;
+
+struct TriviaSpan {
+  size_t start;
+  size_t len;
+  unsigned char kind; // TriviaKind
+};
+
+typedef struct {
+  RawToken tok;
+  const TriviaSpan *leading; // both valid until the next next_trivia_token()
+  size_t nleading;
+  const TriviaSpan *trailing;
+  size_t ntrailing;
+} TriviaToken;
+
+static const char *trivia_name(TriviaKind k) {
+  switch (k) {
+  case TRIVIA_SPACE:
+    return "space";
+  case TRIVIA_LINE_COMMENT:
+    return "line-comment";
+  case TRIVIA_BLOCK_COMMENT:
+    return "block-comment";
+  }
+  return "?";
+}
+
+static void trivia_push(Lexer *lx, TriviaKind kind, size_t start, size_t end) {
+  if (lx->ntrivia == lx->trivia_cap) {
+    size_t cap = lx->trivia_cap ? lx->trivia_cap * 2 : 16;
+    TriviaSpan *p = realloc(lx->trivia, cap * sizeof(*p));
+    if (!p) {
+      perror("realloc");
+      exit(1);
+    }
+    lx->trivia = p;
+    lx->trivia_cap = cap;
+  }
+  TriviaSpan *sp = &lx->trivia[lx->ntrivia++];
+  sp->start = start;
+  sp->len = end - start;
+  sp->kind = (unsigned char)kind;
+}
+
+// Appends the trivia at lx->pos to lx->trivia, one span per whitespace run
+// or comment, counting lines as skip_whitespace_and_comments() does. With
+// to_line_end it stops after the first newline.
+static void scan_trivia(Lexer *lx, int to_line_end) {
+  const unsigned char *s = lx->src;
+  size_t p = lx->pos;
+
+  while (p < lx->len) {
+    size_t start = p;
+    if (CHAR_CLASS[s[p]] & CH_SPACE) {
+      int line_end = 0;
+      while (!line_end && (CHAR_CLASS[s[p]] & CH_SPACE)) {
+        if (s[p] == '\n') {
+          lexer_newline(lx, p);
+          line_end = to_line_end;
+        }
+        p++;
+      }
+      trivia_push(lx, TRIVIA_SPACE, start, p);
+      if (line_end)
+        break;
+    } else if (s[p] == '/' && s[p + 1] == '/') {
+      const unsigned char *nl = memchr(s + p + 2, '\n', lx->len - (p + 2));
+      p = nl ? (size_t)(nl - s) : lx->len;
+      trivia_push(lx, TRIVIA_LINE_COMMENT, start, p);
+    } else if (s[p] == '/' && s[p + 1] == '*') {
+      p = lex_engine->comment_end(lx, p + 2);
+      trivia_push(lx, TRIVIA_BLOCK_COMMENT, start, p);
+    } else {
+      break;
+    }
+  }
+  lx->pos = p;
+}
+
+// next_raw_token() with the trivia around the token. Every token type is
+// returned: dropping any would lose source bytes.
+static void next_trivia_token(Lexer *lx, TriviaToken *t) {
+  lx->ntrivia = 0;
+  scan_trivia(lx, 0);
+  size_t nleading = lx->ntrivia;
+  next_raw_token(lx, &t->tok); // at a token already, nothing left to skip
+  if (t->tok.type != TOK_EOF && t->tok.type != TOK_ERROR)
+    scan_trivia(lx, 1);
+  t->leading = lx->trivia;
+  t->nleading = nleading;
+  t->trailing = lx->trivia ? lx->trivia + nleading : NULL;
+  t->ntrailing = lx->ntrivia - nleading;
+}
+
+/* ---------- Token printing ---------- */
+static const char *token_name(TokenType t) {
+  switch (t) {
+  case TOK_EOF:
+    return "EOF";
+  case TOK_KEYWORD:
+    return "KEYWORD";
+  case TOK_IDENTIFIER:
+    return "IDENTIFIER";
+  case TOK_INT:
+    return "INT";
+  case TOK_FLOAT:
+    return "FLOAT";
+  case TOK_STRING:
+    return "STRING";
+  case TOK_CHAR:
+    return "CHAR";
+  case TOK_OPERATOR:
+    return "OPERATOR";
+  case TOK_SEPARATOR:
+    return "SEPARATOR";
+  case TOK_UNKNOWN:
+    return "UNKNOWN";
+  case TOK_COMMENT:
+    return "COMMENT";
+  case TOK_ERROR:
+    return "ERROR";
+  default:
+    return "???";
+  }
+}
+
+// Parses a comma-separated list of token type names (as printed, any case)
+// into a type mask. Returns 0 and reports the offending name on error.
+static unsigned parse_token_mask(const char *list) {
+  unsigned mask = 0;
+  const char *p = list;
+  while (*p) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    int found = -1;
+    for (int t = 0; t < TOKEN_TYPE_COUNT && found < 0; t++) {
+      const char *name = token_name((TokenType)t);
+      if (strlen(name) != len)
+        continue;
+      size_t k = 0;
+      while (k < len && toupper((unsigned char)p[k]) == name[k])
+        k++;
+      if (k == len)
+        found = t;
+    }
+    if (found < 0) {
+      fprintf(stderr, "Unknown token type: %.*s\n", (int)len, p);
+      return 0;
+    }
+    mask |= 1u << found;
+    if (!end)
+      break;
+    p = end + 1;
+  }
+  return mask;
+}
+
+/* ---------- Benchmark harness ---------- */
+// Synthetic corpora are generated and lexed in memory, so the numbers measure
+// the lexer and not the disk.
+#define BENCH_DEFAULT_MB 4
+#define BENCH_DEFAULT_ITERS 20
+#define BENCH_DEFAULT_WARMUP 3
+
+typedef struct {
+  char *data;
+  size_t len;
+  size_t cap;
+} StrBuf;
+
+static void sb_reserve(StrBuf *b, size_t extra) {
+  if (b->len + extra + 1 <= b->cap)
+    return;
+  size_t cap = b->cap ? b->cap : 4096;
+  while (cap < b->len + extra + 1)
+    cap *= 2;
+  char *p = realloc(b->data, cap);
+  if (!p) {
+    perror("realloc");
+    exit(1);
+  }
+  b->data = p;
+  b->cap = cap;
+}
+
+static void sb_putc(StrBuf *b, char c) {
+  sb_reserve(b, 1);
+  b->data[b->len++] = c;
+  b->data[b->len] = '\0';
+}
+
+static void sb_puts(StrBuf *b, const char *s) {
+  size_t n = strlen(s);
+  sb_reserve(b, n);
+  memcpy(b->data + b->len, s, n + 1);
+  b->len += n;
+}
+
+// Zero-fills LEX_PAD bytes past the end so the buffer can be lexed in place.
+static void sb_pad(StrBuf *b) {
+  sb_reserve(b, LEX_PAD);
+  memset(b->data + b->len, 0, LEX_PAD);
+}
+
+typedef enum {
+  MIX_COMMENT,
+  MIX_STRING,
+  MIX_NUMBER,
+  MIX_IDENT,
+  MIX_OPERATOR,
+  MIX_KIND_COUNT
+} MixKind;
+
+typedef struct {
+  const char *name;
+  int weight[MIX_KIND_COUNT]; // comment, string, number, ident, operator
+} BenchMix;
+
+static const BenchMix BENCH_MIXES[] = {
+    {"mixed", {1, 1, 1, 1, 1}},      {"comment", {8, 1, 1, 1, 1}},
+    {"string", {1, 8, 1, 1, 1}},     {"numeric", {1, 1, 8, 1, 1}},
+    {"identifier", {1, 1, 1, 8, 1}}, {"operator", {1, 1, 1, 1, 8}}};
+static const int BENCH_MIX_COUNT =
+    (int)(sizeof(BENCH_MIXES) / sizeof(BENCH_MIXES[0]));
+
+static uint64_t bench_rand(uint64_t *state) { // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 0x2545F4914F6CDD1DULL;
+}
+
+static int bench_range(uint64_t *rng, int lo, int hi) {
+  return lo + (int)(bench_rand(rng) % (uint64_t)(hi - lo + 1));
+}
+
+static void gen_word(StrBuf *b, uint64_t *rng, int min_len, int max_len) {
+  int n = bench_range(rng, min_len, max_len);
+  for (int i = 0; i < n; i++)
+    sb_putc(b, (char)('a' + bench_range(rng, 0, 25)));
+}
+
+static void gen_identifier(StrBuf *b, uint64_t *rng, int min_len,
+                           int max_len) {
+  int n = bench_range(rng, min_len, max_len);
+  sb_putc(b, (char)('a' + bench_range(rng, 0, 25)));
+  for (int i = 1; i < n; i++) {
+    int r = bench_range(rng, 0, 37);
+    sb_putc(b, r < 26 ? (char)('a' + r) : r < 36 ? (char)('0' + r - 26) : '_');
+  }
+}
+
+static void gen_fragment(StrBuf *b, uint64_t *rng, MixKind kind) {
+  static const char *ops[] = {"+",  "-",  "*",  "/",  "%",  "<",  ">",
+                              "=",  "!",  "&",  "|",  "==", "!=", "<=",
+                              ">=", "&&", "||", "+=", "-=", "*=", "->"};
+  static const char *seps[] = {"(", ")", "{", "}", "[", "]", ";", ","};
+  char num[64];
+
+  switch (kind) {
+  case MIX_COMMENT:
+    if (bench_range(rng, 0, 1)) {
+      sb_puts(b, "// ");
+      for (int i = bench_range(rng, 6, 14); i > 0; i--) {
+        gen_word(b, rng, 2, 9);
+        sb_putc(b, ' ');
+      }
+    } else {
+      sb_puts(b, "/* ");
+      for (int line = bench_range(rng, 1, 3); line > 0; line--) {
+        for (int i = bench_range(rng, 6, 12); i > 0; i--) {
+          gen_word(b, rng, 2, 9);
+          sb_putc(b, ' ');
+        }
+        sb_puts(b, line > 1 ? "\n * " : "*/");
+      }
+    }
+    break;
+  case MIX_STRING:
+    gen_identifier(b, rng, 1, 8);
+    sb_puts(b, " = \"");
+    for (int i = bench_range(rng, 3, 12); i > 0; i--) {
+      gen_word(b, rng, 1, 8);
+      int r = bench_range(rng, 0, 9);
+      sb_puts(b, r == 0 ? "\\n" : r == 1 ? "\\\"" : " ");
+    }
+    sb_puts(b, bench_range(rng, 0, 3) ? "\";" : "\"; c = '\\n';");
+    break;
+  case MIX_NUMBER:
+    for (int i = bench_range(rng, 4, 10); i > 0; i--) {
+      if (bench_range(rng, 0, 1))
+        snprintf(num, sizeof(num), "%d", bench_range(rng, 0, 999999));
+      else
+        snprintf(num, sizeof(num), "%d.%d", bench_range(rng, 0, 9999),
+                 bench_range(rng, 0, 99999));
+      sb_puts(b, num);
+      sb_puts(b, i > 1 ? ", " : ";");
+    }
+    break;
+  case MIX_IDENT:
+    for (int i = bench_range(rng, 2, 5); i > 0; i--) {
+      gen_identifier(b, rng, 16, 80);
+      sb_putc(b, ' ');
+    }
+    break;
+  case MIX_OPERATOR:
+    for (int i = bench_range(rng, 8, 20); i > 0; i--) {
+      gen_identifier(b, rng, 1, 2);
+      sb_puts(b, ops[bench_range(rng, 0, (int)(sizeof(ops) / sizeof(ops[0])) -
+                                             1)]);
+      if (bench_range(rng, 0, 3) == 0)
+        sb_puts(b, seps[bench_range(rng, 0, 7)]);
+    }
+    sb_putc(b, ';');
+    break;
+  default:
+    break;
+  }
+  sb_putc(b, '\n');
+  for (int i = bench_range(rng, 0, 3) * 2; i > 0; i--)
+    sb_putc(b, ' ');
+}
+
+static void gen_corpus(StrBuf *b, const BenchMix *mix, size_t target,
+                       uint64_t seed) {
+  uint64_t rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+  int total = 0;
+  for (int k = 0; k < MIX_KIND_COUNT; k++)
+    total += mix->weight[k];
+  if (total <= 0)
+    return;
+
+  while (b->len < target) {
+    int r = bench_range(&rng, 0, total - 1);
+    int k = 0;
+    while (r >= mix->weight[k]) {
+      r -= mix->weight[k];
+      k++;
+    }
+    gen_fragment(b, &rng, (MixKind)k);
+  }
+}
+
+// A bench path lexes the whole stream and returns the number of tokens.
+typedef size_t (*BenchPathFn)(Lexer *lx, FILE *sink);
+
+static size_t bench_path_tokens(Lexer *lx, FILE *sink) {
+  (void)sink;
+  size_t n = 0;
+  while (1) {
+    Token t = next_token(lx);
+    n++;
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+  }
+  return n;
+}
+
+static size_t bench_path_count(Lexer *lx, FILE *sink) {
+  (void)sink;
+  size_t n = 0;
+  RawToken t;
+  do {
+    next_raw_token(lx, &t);
+    n++;
+  } while (t.type != TOK_EOF && t.type != TOK_ERROR);
+  return n;
+}
+
+// Secrets-scanning shape: only identifiers and strings are materialized.
+static size_t bench_path_filter(Lexer *lx, FILE *sink) {
+  (void)sink;
+  size_t n = 0;
+  lx->type_mask =
+      (1u << TOK_IDENTIFIER) | (1u << TOK_STRING) | TOKEN_MASK_ALWAYS;
+  while (1) {
+    Token t = next_token(lx);
+    n++;
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+  }
+  return n;
+}
+
+static size_t bench_path_print(Lexer *lx, FILE *sink) {
+  size_t n = 0;
+  while (1) {
+    Token t = next_token(lx);
+    fprintf(sink, "[%d:%d] %-10s  \"%s\"\n", t.line, t.col, token_name(t.type),
+            t.lexeme);
+    n++;
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+  }
+  return n;
+}
+
+// Recursive-descent shape: one token of lookahead everywhere and, at each
+// call, a speculative look at the arguments that is then backtracked over.
+static size_t bench_path_lookahead(Lexer *lx, FILE *sink) {
+  (void)sink;
+  Lookahead la;
+  lookahead_init(&la, lx);
+  size_t n = 1; // EOF or the error
+  while (1) {
+    const RawToken *t = lookahead_peek(&la, 0);
+    if (t->type == TOK_EOF || t->type == TOK_ERROR)
+      break;
+    int ident = t->type == TOK_IDENTIFIER;
+    const RawToken *next = lookahead_peek(&la, 1);
+    if (ident && next->kind == SEP_LPAREN) {
+      LookaheadMark m = lookahead_mark(&la);
+      for (int i = 0; i < 4; i++)
+        lookahead_advance(&la);
+      lookahead_reset(&la, m);
+      lookahead_release(&la);
+    }
+    lookahead_advance(&la);
+    n++;
+  }
+  lookahead_free(&la);
+  return n;
+}
+
+typedef struct {
+  const char *name;
+  BenchPathFn run;
+} BenchPath;
+
+static const BenchPath BENCH_PATHS[] = {{"count", bench_path_count},
+                                        {"tokens", bench_path_tokens},
+                                        {"filter", bench_path_filter},
+                                        {"print", bench_path_print},
+                                        {"lookahead", bench_path_lookahead}};
+static const int BENCH_PATH_COUNT =
+    (int)(sizeof(BENCH_PATHS) / sizeof(BENCH_PATHS[0]));
+
+static int cmp_double(const void *a, const void *b) {
+  double x = *(const double *)a, y = *(const double *)b;
+  return (x > y) - (x < y);
+}
+
+// p-th percentile (0..100) of an already sorted sample.
+static double percentile(const double *sorted, int n, double p) {
+  int idx = (int)(p / 100.0 * (double)n + 0.999999) - 1;
+  if (idx < 0)
+    idx = 0;
+  if (idx >= n)
+    idx = n - 1;
+  return sorted[idx];
+}
+
+static int bench_one(const BenchMix *mix, const StrBuf *corpus,
+                     const BenchPath *path, FILE *sink, int warmup,
+                     int iters) {
+  double *times = malloc(sizeof(double) * (size_t)iters);
+  size_t tokens = 0;
+  if (!times) {
+    perror("malloc");
+    return 1;
+  }
+
+  // One Lexer for every iteration, as in batch mode: after the warmup its
+  // arena holds all the lexemes without going back to malloc.
+  Lexer lx;
+  lexer_init(&lx);
+  for (int i = 0; i < warmup + iters; i++) {
+    lexer_reset(&lx);
+    lexer_set_input(&lx, corpus->data, corpus->len);
+    lx.type_mask = TOKEN_MASK_ALL;
+    double t0 = now_seconds();
+    if (lex_use_index)
+      lexer_build_index(&lx);
+    tokens = path->run(&lx, sink);
+    double t1 = now_seconds();
+    if (i >= warmup)
+      times[i - warmup] = t1 - t0;
+  }
+  lexer_free(&lx);
+
+  qsort(times, (size_t)iters, sizeof(double), cmp_double);
+  // p99 throughput is taken from the p99 (slow tail) iteration time.
+  double med = percentile(times, iters, 50.0);
+  double p99 = percentile(times, iters, 99.0);
+  double mb = (double)corpus->len / (1024.0 * 1024.0);
+  printf("{\"mix\":\"%s\",\"path\":\"%s\",\"engine\":\"%s\",\"bytes\":%zu,"
+         "\"tokens\":%zu,\"iterations\":%d,\"median_mb_s\":%.2f,"
+         "\"p99_mb_s\":%.2f,\"median_tok_s\":%.0f,\"p99_tok_s\":%.0f}\n",
+         mix->name, path->name, engine_name(), corpus->len, tokens, iters,
+         mb / med,
+         mb / p99, (double)tokens / med, (double)tokens / p99);
+  fflush(stdout);
+  free(times);
+  return 0;
+}
+
+static int name_in_list(const char *name, const char *list) {
+  size_t n = strlen(name);
+  const char *p = list;
+  while (p && *p) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len == n && strncmp(p, name, n) == 0)
+      return 1;
+    p = end ? end + 1 : NULL;
+  }
+  return 0;
+}
+
+// Options: --bench[=mix,...] --bench-path=path,... --bench-size=MB
+//          --bench-iters=N --bench-warmup=N --bench-seed=N
+//          --bench-mix=comment,string,number,ident,operator (custom weights)
+static int run_bench(int argc, char **argv) {
+  const char *mixes = NULL, *paths = NULL;
+  double size_mb = BENCH_DEFAULT_MB;
+  int iters = BENCH_DEFAULT_ITERS, warmup = BENCH_DEFAULT_WARMUP;
+  uint64_t seed = 0;
+  BenchMix custom = {"custom", {0}};
+  int have_custom = 0;
+
+  for (int i = 0; i < argc; i++) {
+    const char *a = argv[i];
+    if (strncmp(a, "--bench=", 8) == 0)
+      mixes = a + 8;
+    else if (strncmp(a, "--bench-path=", 13) == 0)
+      paths = a + 13;
+    else if (strncmp(a, "--bench-size=", 13) == 0)
+      size_mb = atof(a + 13);
+    else if (strncmp(a, "--bench-iters=", 14) == 0)
+      iters = atoi(a + 14);
+    else if (strncmp(a, "--bench-warmup=", 15) == 0)
+      warmup = atoi(a + 15);
+    else if (strncmp(a, "--bench-seed=", 13) == 0)
+      seed = strtoull(a + 13, NULL, 10);
+    else if (strncmp(a, "--bench-mix=", 12) == 0) {
+      if (sscanf(a + 12, "%d,%d,%d,%d,%d", &custom.weight[0],
+                 &custom.weight[1], &custom.weight[2], &custom.weight[3],
+                 &custom.weight[4]) != MIX_KIND_COUNT) {
+        fprintf(stderr, "--bench-mix expects five comma-separated weights\n");
+        return 1;
+      }
+      have_custom = 1;
+    } else if (strcmp(a, "--bench") != 0 && strncmp(a, "--engine=", 9) != 0) {
+      fprintf(stderr, "Unknown benchmark option: %s\n", a);
+      return 1;
+    }
+  }
+  if (iters < 1 || warmup < 0 || size_mb <= 0) {
+    fprintf(stderr, "Invalid benchmark parameters\n");
+    return 1;
+  }
+
+  FILE *sink = fopen("/dev/null", "w");
+  if (!sink) {
+    perror("fopen /dev/null");
+    return 1;
+  }
+
+  size_t target = (size_t)(size_mb * 1024.0 * 1024.0);
+  int rc = 0;
+  for (int m = 0; m < BENCH_MIX_COUNT + have_custom && rc == 0; m++) {
+    const BenchMix *mix = m < BENCH_MIX_COUNT ? &BENCH_MIXES[m] : &custom;
+    if (m < BENCH_MIX_COUNT && (have_custom || mixes) &&
+        !(mixes && name_in_list(mix->name, mixes)))
+      continue;
+
+    StrBuf corpus = {0};
+    gen_corpus(&corpus, mix, target, seed);
+    sb_pad(&corpus);
+    for (int p = 0; p < BENCH_PATH_COUNT && rc == 0; p++) {
+      if (paths && !name_in_list(BENCH_PATHS[p].name, paths))
+        continue;
+      rc = bench_one(mix, &corpus, &BENCH_PATHS[p], sink, warmup, iters);
+    }
+    free(corpus.data);
+  }
+
+  fclose(sink);
+  return rc;
+}
+
+/* ---------- Per-scanner microbenchmarks ---------- */
+// Each scanner is driven directly (no next_token, no whitespace skipping) on
+// an in-memory input of single-space separated tokens of its own kind.
+#define MICRO_DEFAULT_TOKENS 200000
+#define MICRO_DEFAULT_ITERS 15
+
+#if defined(__x86_64__) || defined(__i386__)
+#define CYCLE_CLOCK "tsc"
+static uint64_t cycle_now(void) { return __rdtsc(); }
+#else
+#define CYCLE_CLOCK "ns" // no portable cycle counter: report nanoseconds
+static uint64_t cycle_now(void) {
+  return (uint64_t)(now_seconds() * 1e9);
+}
+#endif
+
+static void gen_micro_ident(StrBuf *b, uint64_t *rng) {
+  if (bench_range(rng, 0, 3) == 0)
+    sb_puts(b, KEYWORDS[bench_range(rng, 0, KEYWORD_COUNT - 1)]);
+  else
+    gen_identifier(b, rng, 1, 32);
+}
+
+static void gen_micro_number(StrBuf *b, uint64_t *rng) {
+  char num[64];
+  if (bench_range(rng, 0, 1))
+    snprintf(num, sizeof(num), "%d", bench_range(rng, 0, 9999999));
+  else
+    snprintf(num, sizeof(num), "%d.%d", bench_range(rng, 0, 99999),
+             bench_range(rng, 0, 999999));
+  sb_puts(b, num);
+}
+
+static void gen_micro_string(StrBuf *b, uint64_t *rng) {
+  sb_putc(b, '"');
+  for (int i = bench_range(rng, 1, 6); i > 0; i--) {
+    gen_word(b, rng, 1, 8);
+    sb_puts(b, bench_range(rng, 0, 4) ? " " : "\\t");
+  }
+  sb_putc(b, '"');
+}
+
+static void gen_micro_char(StrBuf *b, uint64_t *rng) {
+  static const char *esc[] = {"'\\n'", "'\\t'", "'\\''", "'\\\\'"};
+  if (bench_range(rng, 0, 3) == 0) {
+    sb_puts(b, esc[bench_range(rng, 0, 3)]);
+  } else {
+    sb_putc(b, '\'');
+    sb_putc(b, (char)('a' + bench_range(rng, 0, 25)));
+    sb_putc(b, '\'');
+  }
+}
+
+static void gen_micro_operator(StrBuf *b, uint64_t *rng) {
+  static const char *ops[] = {"+",  "-",  "*",  "%",  "<",  ">",  "=",  "!",
+                              "&",  "|",  "^",  "~",  "?",  ":",  ".",  "==",
+                              "!=", "<=", ">=", "&&", "||", "++", "--", "+=",
+                              "-=", "*=", "/=", "%=", "->", "(",  ")",  "{",
+                              "}",  "[",  "]",  ";",  ","};
+  sb_puts(b, ops[bench_range(rng, 0, (int)(sizeof(ops) / sizeof(ops[0])) - 1)]);
+}
+
+typedef struct {
+  ScannerId id;
+  void (*gen)(StrBuf *b, uint64_t *rng);
+} MicroScanner;
+
+static const MicroScanner MICRO_SCANNERS[] = {
+    {SCAN_IDENT, gen_micro_ident},     {SCAN_NUMBER, gen_micro_number},
+    {SCAN_STRING, gen_micro_string},   {SCAN_CHAR, gen_micro_char},
+    {SCAN_OPERATOR, gen_micro_operator}};
+static const int MICRO_SCANNER_COUNT =
+    (int)(sizeof(MICRO_SCANNERS) / sizeof(MICRO_SCANNERS[0]));
+
+static int micro_one(const MicroScanner *ms, int ntokens, int iters) {
+  StrBuf in = {0};
+  uint64_t rng = 0x9E3779B97F4A7C15ULL;
+  for (int i = 0; i < ntokens; i++) {
+    ms->gen(&in, &rng);
+    sb_putc(&in, ' ');
+  }
+  sb_pad(&in);
+
+  double *cycles = malloc(sizeof(double) * (size_t)iters);
+  if (!cycles) {
+    perror("malloc");
+    free(in.data);
+    return 1;
+  }
+
+  Lexer lx;
+  lexer_init(&lx);
+  for (int it = 0; it <= iters; it++) { // iteration 0 is warmup
+    lexer_set_input(&lx, in.data, in.len);
+    ScannerFn scan = SCANNERS[ms->id];
+    RawToken t;
+    volatile unsigned char sink = 0;
+    uint64_t c0 = cycle_now();
+    for (int i = 0; i < ntokens; i++) {
+      scan(&lx, &t);
+      sink = t.type;
+      lx.pos++; // separator
+    }
+    uint64_t c1 = cycle_now();
+    (void)sink;
+    if (it > 0)
+      cycles[it - 1] = (double)(c1 - c0);
+  }
+
+  qsort(cycles, (size_t)iters, sizeof(double), cmp_double);
+  double med = percentile(cycles, iters, 50.0);
+  printf("{\"scanner\":\"%s\",\"engine\":\"%s\",\"clock\":\"%s\","
+         "\"bytes\":%zu,\"tokens\":%d,\"iterations\":%d,"
+         "\"cycles_per_byte\":%.2f,\"cycles_per_token\":%.2f}\n",
+         SCANNER_NAMES[ms->id], lex_engine->name, CYCLE_CLOCK, in.len, ntokens,
+         iters,
+         med / (double)in.len, med / (double)ntokens);
+  fflush(stdout);
+  free(cycles);
+  free(in.data);
+  return 0;
+}
+
+// Options: --microbench[=scanner,...] --microbench-tokens=N
+//          --microbench-iters=N
+static int run_microbench(int argc, char **argv) {
+  const char *only = NULL;
+  int ntokens = MICRO_DEFAULT_TOKENS, iters = MICRO_DEFAULT_ITERS;
+
+  for (int i = 0; i < argc; i++) {
+    const char *a = argv[i];
+    if (strncmp(a, "--microbench=", 13) == 0)
+      only = a + 13;
+    else if (strncmp(a, "--microbench-tokens=", 20) == 0)
+      ntokens = atoi(a + 20);
+    else if (strncmp(a, "--microbench-iters=", 19) == 0)
+      iters = atoi(a + 19);
+    else if (strcmp(a, "--microbench") != 0 &&
+             strncmp(a, "--engine=", 9) != 0) {
+      fprintf(stderr, "Unknown microbenchmark option: %s\n", a);
+      return 1;
+    }
+  }
+  if (ntokens < 1 || iters < 1) {
+    fprintf(stderr, "Invalid microbenchmark parameters\n");
+    return 1;
+  }
+
+  for (int i = 0; i < MICRO_SCANNER_COUNT; i++) {
+    if (only && !name_in_list(SCANNER_NAMES[MICRO_SCANNERS[i].id], only))
+      continue;
+    if (micro_one(&MICRO_SCANNERS[i], ntokens, iters))
+      return 1;
+  }
+  return 0;
+}
+
+/* ---------- Hardware performance counters (--perf) ---------- */
+typedef enum {
+  PC_CYCLES,
+  PC_INSTRUCTIONS,
+  PC_BRANCH_MISSES,
+  PC_CACHE_MISSES,
+  PERF_COUNTER_COUNT
+} PerfCounterId;
+
+static const char *PERF_COUNTER_NAMES[PERF_COUNTER_COUNT] = {
+    "cycles", "instructions", "branch-misses", "cache-misses"};
+
+typedef struct {
+  int fd[PERF_COUNTER_COUNT]; // -1 when that counter could not be opened
+  uint64_t value[PERF_COUNTER_COUNT];
+} PerfCounters;
+
+// Opens whatever counters the kernel/hardware allows for the calling thread.
+// Returns the number opened; on 0 the reason is printed if report is set and
+// lexing runs unmeasured.
+static int perf_open(PerfCounters *pc, int report) {
+  int opened = 0;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++)
+    pc->fd[i] = -1;
+#ifdef __linux__
+  static const uint64_t config[PERF_COUNTER_COUNT] = {
+      PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS,
+      PERF_COUNT_HW_BRANCH_MISSES, PERF_COUNT_HW_CACHE_MISSES};
+  int err = 0;
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = config[i];
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    long fd = syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0) {
+      err = errno;
+      continue;
+    }
+    pc->fd[i] = (int)fd;
+    opened++;
+  }
+  if (opened == 0 && report)
+    fprintf(stderr, "perf: hardware counters unavailable (%s)\n",
+            strerror(err));
+#else
+  if (report)
+    fprintf(stderr, "perf: hardware counters are only supported on Linux\n");
+#endif
+  return opened;
+}
+
+static void perf_close(PerfCounters *pc) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (pc->fd[i] >= 0)
+      close(pc->fd[i]);
+    pc->fd[i] = -1;
+  }
+#else
+  (void)pc;
+#endif
+}
+
+static void perf_start(PerfCounters *pc) {
+#ifdef __linux__
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (pc->fd[i] >= 0) {
+      ioctl(pc->fd[i], PERF_EVENT_IOC_RESET, 0);
+      ioctl(pc->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+  }
+#else
+  (void)pc;
+#endif
+}
+
+static void perf_stop(PerfCounters *pc) {
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    pc->value[i] = 0;
+#ifdef __linux__
+    if (pc->fd[i] < 0)
+      continue;
+    ioctl(pc->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+    uint64_t v;
+    if (read(pc->fd[i], &v, sizeof(v)) == (ssize_t)sizeof(v))
+      pc->value[i] = v;
+    else
+      pc->fd[i] = -1; // treat as unavailable from now on
+#endif
+  }
+}
+
+static void print_perf(FILE *out, const char *path, const PerfCounters *pc,
+                       size_t bytes, size_t tokens) {
+  double mb = (double)bytes / (1024.0 * 1024.0);
+  fprintf(out, "Perf counters for %s (%zu bytes, %zu tokens):\n", path, bytes,
+          tokens);
+  for (int i = 0; i < PERF_COUNTER_COUNT; i++) {
+    if (pc->fd[i] < 0) {
+      fprintf(out, "  %-14s n/a\n", PERF_COUNTER_NAMES[i]);
+      continue;
+    }
+    double v = (double)pc->value[i];
+    fprintf(out, "  %-14s %14llu  %10.3f/byte  %14.0f/MB  %10.3f/token\n",
+            PERF_COUNTER_NAMES[i], (unsigned long long)pc->value[i],
+            bytes ? v / (double)bytes : 0.0, mb > 0 ? v / mb : 0.0,
+            tokens ? v / (double)tokens : 0.0);
+  }
+  if (pc->fd[PC_CYCLES] >= 0 && pc->fd[PC_INSTRUCTIONS] >= 0 &&
+      pc->value[PC_CYCLES])
+    fprintf(out, "  %-14s %14.2f\n", "IPC",
+            (double)pc->value[PC_INSTRUCTIONS] / (double)pc->value[PC_CYCLES]);
+}
+
+/* ---------- Input loading ---------- */
+// Reads a whole file into arena memory followed by LEX_PAD zero bytes. The
+// buffer is sized from fstat() up front, so a regular file costs one
+// allocation; it grows by copying only if the file is still growing (or is
+// not a regular file). Returns NULL (after printing why to err) on failure.
+static char *read_file(const char *path, Arena *a, size_t *len_out,
+                       FILE *err) {
+  FILE *fp = fopen(path, "rb");
+  if (!fp) {
+    fprintf(err, "%s: %s\n", path, strerror(errno));
+    return NULL;
+  }
+
+  struct stat sb;
+  size_t len = 0, cap = 1 << 16;
+  if (fstat(fileno(fp), &sb) == 0 && S_ISREG(sb.st_mode))
+    cap = (size_t)sb.st_size + 1; // +1 to see EOF without growing
+  char *buf = arena_alloc(a, cap + LEX_PAD);
+  while (1) {
+    len += fread(buf + len, 1, cap - len, fp);
+    if (len < cap)
+      break;
+    char *grown = arena_alloc(a, cap * 2 + LEX_PAD);
+    memcpy(grown, buf, len);
+    buf = grown;
+    cap *= 2;
+  }
+  if (ferror(fp)) {
+    fprintf(err, "%s: %s\n", path, strerror(errno));
+    fclose(fp);
+    return NULL;
+  }
+  fclose(fp);
+
+  memset(buf + len, 0, LEX_PAD);
+  *len_out = len;
+  return buf;
+}
+
+/* ---------- Token shingles ---------- */
+// Clone detection compares runs of k tokens ("k-gram shingles") rather than
+// text, so that renaming variables, changing literals or reformatting does
+// not hide a copy. Identifiers and literals are reduced to their token type;
+// keywords, operators and separators keep their identity. Each shingle gets a
+// polynomial rolling hash, updated in O(1) per token as the window slides.
+#define SHINGLE_K_DEFAULT 10 // tokens per shingle
+#define WINNOW_W_DEFAULT 8   // shingles per winnowing window
+#define SHINGLE_BASE 0x100000001b3ULL
+
+typedef struct {
+  int k;
+  uint64_t base_k; // SHINGLE_BASE^k, to drop the oldest token
+  uint64_t h;      // hash of the last k tokens, once n >= k
+  uint64_t *vals;  // last k token values, a ring; vals[slot] is the oldest
+  int *lines;
+  int slot;
+  size_t n; // tokens pushed so far
+} Shingler;
+
+static void shingler_init(Shingler *sh, int k, Arena *a) {
+  sh->k = k;
+  sh->base_k = 1;
+  for (int i = 0; i < k; i++)
+    sh->base_k *= SHINGLE_BASE;
+  sh->h = 0;
+  sh->vals = arena_alloc(a, (size_t)k * sizeof(uint64_t));
+  sh->lines = arena_alloc(a, (size_t)k * sizeof(int));
+  sh->slot = 0;
+  sh->n = 0;
+}
+
+// The normalized value of a token: what two clones must agree on.
+static uint64_t shingle_value(const Lexer *lx, const RawToken *t) {
+  uint64_t v;
+  switch (t->type) {
+  case TOK_IDENTIFIER:
+  case TOK_INT:
+  case TOK_FLOAT:
+  case TOK_STRING:
+  case TOK_CHAR:
+    v = t->type;
+    break;
+  default:
+    v = (uint64_t)t->type << 16 | (uint64_t)t->kind << 8 | lx->src[t->start];
+    break;
+  }
+  return hash_word(HASH_SEED, v);
+}
+
+// Adds a token. Returns 1 once a whole shingle is in sh->h; *line_out is then
+// the line of its first token.
+static int shingler_push(Shingler *sh, uint64_t v, int line, int *line_out) {
+  int slot = sh->slot;
+  sh->h = sh->h * SHINGLE_BASE + v;
+  if (sh->n >= (size_t)sh->k)
+    sh->h -= sh->vals[slot] * sh->base_k;
+  sh->vals[slot] = v;
+  sh->lines[slot] = line;
+  sh->slot = slot + 1 == sh->k ? 0 : slot + 1;
+  if (++sh->n < (size_t)sh->k)
+    return 0;
+  *line_out = sh->lines[sh->slot];
+  return 1;
+}
+
+// The rolling hash is a poor key on its own (nearby shingles differ only in
+// the low-order terms); this spreads it before minima are taken.
+static inline uint64_t shingle_mix(uint64_t h) {
+  h ^= h >> 31;
+  h *= 0xbf58476d1ce4e5b9ULL;
+  h ^= h >> 27;
+  h *= 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+// Winnowing (Schleimer, Wilkerson and Aiken): of every w consecutive shingle
+// hashes keep the smallest and record it once. Any run of w + k - 1 tokens
+// shared by two files yields at least one common fingerprint. On ties the
+// current pick is kept while it is in the window, else the rightmost minimum
+// is taken ("robust winnowing"), so long repetitive runs such as tables give
+// one fingerprint per window instead of one per token. The candidates form a
+// deque with increasing hashes, so each shingle is handled in amortized O(1).
+typedef struct {
+  uint64_t hash;
+  size_t pos; // shingle number
+  int line;
+} WinnowEntry;
+
+typedef struct {
+  int w;
+  WinnowEntry *dq; // ring of at least w entries, a power of two
+  size_t mask;
+  size_t head, len;
+  size_t n;        // shingles pushed so far
+  WinnowEntry last; // last recorded, pos SIZE_MAX before the first
+} Winnower;
+
+static void winnow_init(Winnower *wn, int w, Arena *a) {
+  wn->w = w;
+  size_t cap = 1;
+  while (cap < (size_t)w)
+    cap *= 2;
+  wn->dq = arena_alloc(a, cap * sizeof(WinnowEntry));
+  wn->mask = cap - 1;
+  wn->head = wn->len = 0;
+  wn->n = 0;
+  wn->last.pos = SIZE_MAX;
+}
+
+// Adds a shingle hash. Returns 1 and sets *fp when a new fingerprint is
+// selected.
+static int winnow_push(Winnower *wn, uint64_t hash, int line,
+                       WinnowEntry *fp) {
+  size_t w = (size_t)wn->w, pos = wn->n++;
+  while (wn->len && wn->dq[(wn->head + wn->len - 1) & wn->mask].hash >= hash)
+    wn->len--;
+  if (wn->len && wn->dq[wn->head].pos + w <= pos) {
+    wn->head = (wn->head + 1) & wn->mask;
+    wn->len--;
+  }
+  wn->dq[(wn->head + wn->len++) & wn->mask] = (WinnowEntry){hash, pos, line};
+  if (pos + 1 < w)
+    return 0;
+  const WinnowEntry *min = &wn->dq[wn->head];
+  if (wn->last.pos != SIZE_MAX && wn->last.pos + w > pos &&
+      wn->last.hash == min->hash)
+    return 0; // still a minimum of this window
+  *fp = wn->last = *min;
+  return 1;
+}
+
+// A file with fewer than w shingles never fills a window; it still gets its
+// smallest one, so short clones are not lost entirely.
+static int winnow_finish(Winnower *wn, WinnowEntry *fp) {
+  if (wn->n == 0 || wn->n >= (size_t)wn->w)
+    return 0;
+  *fp = wn->dq[wn->head];
+  return 1;
+}
+
+/* ---------- Near-duplicate files (--minhash) ---------- */
+// Each file's set of shingles is summarized by a MinHash signature, so two
+// files' Jaccard similarity (shared shingles over all shingles) can be
+// estimated as the fraction of equal signature entries. Instead of one hash
+// function per entry, one-permutation hashing splits each shingle hash into a
+// bin (its top bits) and a value, and each entry keeps the smallest value
+// seen in its bin: O(1) per token instead of O(entries). Bins no shingle fell
+// into are filled from the next non-empty bin ("densification", Shrivastava
+// and Li) so that small files still compare correctly.
+//
+// Candidates come from LSH banding: the signature is cut into b bands of r
+// entries, and files that agree on a whole band are compared. r and b are
+// picked so that a pair right at the threshold is found with probability
+// MINHASH_RECALL.
+#define MINHASH_BINS 128
+#define MINHASH_BIN_BITS 7 // log2(MINHASH_BINS)
+#define MINHASH_EMPTY UINT32_MAX
+#define MINHASH_THRESHOLD_DEFAULT 0.8
+#define MINHASH_RECALL 0.95
+
+typedef struct {
+  const char *path; // owned by the caller's path list
+  uint32_t sig[MINHASH_BINS];
+} MinHashEntry;
+
+// Signatures of all files of a run, added by all workers.
+typedef struct {
+  double threshold;
+  MinHashEntry *items;
+  size_t len, cap;
+  pthread_mutex_t lock;
+} MinHashSet;
+
+static void minhash_set_init(MinHashSet *ms, double threshold) {
+  memset(ms, 0, sizeof(*ms));
+  ms->threshold = threshold;
+  pthread_mutex_init(&ms->lock, NULL);
+}
+
+static void minhash_set_free(MinHashSet *ms) {
+  free(ms->items);
+  pthread_mutex_destroy(&ms->lock);
+}
+
+static void minhash_add(MinHashSet *ms, const char *path, const uint32_t *sig) {
+  pthread_mutex_lock(&ms->lock);
+  if (ms->len == ms->cap) {
+    ms->cap = ms->cap ? ms->cap * 2 : 256;
+    ms->items = realloc(ms->items, ms->cap * sizeof(MinHashEntry));
+    if (!ms->items) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  MinHashEntry *e = &ms->items[ms->len++];
+  e->path = path;
+  memcpy(e->sig, sig, sizeof(e->sig));
+  pthread_mutex_unlock(&ms->lock);
+}
+
+// Fills empty bins from the next non-empty one to the right (wrapping), plus
+// a per-distance offset so borrowed values differ from the originals.
+// Returns 0 if every bin is empty (fewer than k tokens).
+static int minhash_densify(uint32_t *sig) {
+  int first = -1;
+  for (int i = 0; i < MINHASH_BINS && first < 0; i++)
+    if (sig[i] != MINHASH_EMPTY)
+      first = i;
+  if (first < 0)
+    return 0;
+  uint32_t next = sig[first];
+  unsigned dist = 0;
+  for (int n = 0, i = first; n < MINHASH_BINS; n++) {
+    i = i == 0 ? MINHASH_BINS - 1 : i - 1; // right to left from first
+    if (sig[i] != MINHASH_EMPTY) {
+      next = sig[i];
+      dist = 0;
+    } else {
+      sig[i] = next + ++dist * 0x9e3779b9u;
+    }
+  }
+  return 1;
+}
+
+/* ---------- File driver ---------- */
+typedef struct {
+  unsigned only;   // --only: token type mask, TOKEN_MASK_ALL by default
+  int count;       // --count: per-type totals only, no listing
+  int trivia;      // --trivia: listing with whitespace and comment spans
+  int roundtrip;   // --roundtrip: rebuild each file from tokens and trivia
+  int minify;      // --minify: the source without comments and spare spaces
+  int fingerprint; // --fingerprint: winnowed k-gram fingerprints
+  const char *fingerprint_dir; // --fingerprint=DIR: one .fp file per input
+  int kgram;                   // --kgram: tokens per shingle
+  int window;                  // --window: shingles per winnowing window
+  int stats;       // --stats
+  int perf;        // --perf, and at least one counter could be opened
+  int multi_file;  // more than one input: prefix output with the file name
+  int skip_binary; // directory mode: skip files containing NUL bytes
+  Interner *interner; // --symbols: shared by all files and workers
+  MinHashSet *minhash; // --minhash: signatures of all files, shared likewise
+  int dedupe;          // --dedupe: lex each distinct file content once
+} LexOptions;
+
+#define BINARY_PROBE_LEN 8192 // bytes checked for NUL by skip_binary
+
+#if LEXER_STATS
+static long peak_rss_kb(void) {
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) != 0)
+    return -1;
+#ifdef __APPLE__
+  return (long)(ru.ru_maxrss / 1024); // bytes on macOS
+#else
+  return (long)ru.ru_maxrss; // kilobytes on Linux/BSD
+#endif
+}
+
+static void print_stats(FILE *out, const char *path, const LexStats *st,
+                        double wall) {
+  unsigned long total =
+      st->bytes_whitespace + st->bytes_comment + st->bytes_token;
+  fprintf(out, "Stats for %s:\n", path);
+  fprintf(out, "  tokens:\n");
+  for (int t = 0; t < TOKEN_TYPE_COUNT; t++) {
+    if (st->tokens[t])
+      fprintf(out, "    %-10s  %lu\n", token_name((TokenType)t),
+              st->tokens[t]);
+  }
+  fprintf(out,
+          "  bytes:       %lu total, %lu whitespace, %lu comments, "
+          "%lu tokens\n",
+          total, st->bytes_whitespace, st->bytes_comment, st->bytes_token);
+  if (st->longest.len > 0)
+    fprintf(out, "  longest:     %s, %zu bytes at [%d:%d]\n",
+            token_name((TokenType)st->longest.type), st->longest.len,
+            st->longest.line, st->longest.col);
+  fprintf(out, "  scanners:\n");
+  for (int i = 0; i < SCANNER_COUNT; i++) {
+    if (st->scanner_calls[i])
+      fprintf(out, "    %-27s %8lu calls  %10.3f ms\n", SCANNER_NAMES[i],
+              st->scanner_calls[i], st->scanner_time[i] * 1e3);
+  }
+  fprintf(out, "  wall time:   %.3f ms\n", wall * 1e3);
+  fprintf(out, "  peak RSS:    %ld KB\n", peak_rss_kb());
+}
+#endif
+
+static void print_listing_header(FILE *out) {
+  fprintf(out, "Lexical Analysis Output:\n");
+  fprintf(out, "------------------------\n");
+}
+
+// One listing line (plus the stop notice after an error).
+static void print_token(FILE *out, const Token *t) {
+  if (t->type == TOK_COMMENT)
+    fprintf(out, "[%d:%d] %-10s  \"%s\" (%s)\n", t->line, t->col,
+            token_name(t->type), t->lexeme,
+            t->kind == CMT_DOC    ? "doc"
+            : t->kind == CMT_LINE ? "line"
+                                  : "block");
+  else if (t->sym)
+    fprintf(out, "[%d:%d] %-10s  \"%s\" #%u\n", t->line, t->col,
+            token_name(t->type), t->lexeme, (unsigned)t->sym);
+  else
+    fprintf(out, "[%d:%d] %-10s  \"%s\"\n", t->line, t->col,
+            token_name(t->type), t->lexeme);
+  if (t->type == TOK_ERROR)
+    fprintf(out, "Stopping due to error.\n");
+}
+
+// Default output: one line per token. Returns the number of tokens.
+static size_t emit_listing(Lexer *lx, FILE *out) {
+  size_t ntokens = 0;
+  print_listing_header(out);
+  while (1) {
+    Token t = next_token(lx);
+    ntokens++;
+    print_token(out, &t);
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+  }
+  return ntokens;
+}
+
+// The --count report. counts is indexed by TokenType; last is the final
+// token (EOF or the error that stopped lexing).
+static void print_counts(FILE *out, const size_t *counts, unsigned mask,
+                         size_t lines, const RawToken *last) {
+  size_t total = 0;
+  for (int i = 0; i < TOKEN_TYPE_COUNT; i++)
+    total += counts[i];
+  fprintf(out, "Token counts:\n");
+  for (int i = 0; i < TOKEN_TYPE_COUNT; i++) {
+    if (i != TOK_EOF && ((mask >> i) & 1u))
+      fprintf(out, "  %-10s  %zu\n", token_name((TokenType)i), counts[i]);
+  }
+  fprintf(out, "  %-10s  %zu\n", "total", total - counts[TOK_EOF]);
+  fprintf(out, "  %-10s  %zu\n", "lines", lines);
+  if (last->type == TOK_ERROR)
+    fprintf(out, "Stopped at error [%d:%d]: %s\n", last->line, last->col,
+            LEX_ERROR_MESSAGES[last->err]);
+}
+
+// --count: the scanners only classify and advance; no Token is built and
+// nothing is printed per token. Returns the number of tokens.
+static size_t emit_counts(Lexer *lx, FILE *out) {
+  size_t counts[TOKEN_TYPE_COUNT] = {0};
+  size_t total = 0;
+  RawToken t;
+  do {
+    next_wanted_raw_token(lx, &t);
+    counts[t.type]++;
+  } while (t.type != TOK_EOF && t.type != TOK_ERROR);
+  for (int i = 0; i < TOKEN_TYPE_COUNT; i++)
+    total += counts[i];
+
+  size_t lines = (size_t)lx->line;
+  if (lx->len == 0 || lx->src[lx->len - 1] == '\n')
+    lines--; // no partial last line
+  print_counts(out, counts, lx->type_mask, lines, &t);
+  return total;
+}
+
+static void print_trivia(FILE *out, const char *label, const TriviaSpan *sp,
+                         size_t n) {
+  if (n == 0)
+    return;
+  fprintf(out, "    %s:", label);
+  for (size_t i = 0; i < n; i++)
+    fprintf(out, " %s@%zu+%zu", trivia_name((TriviaKind)sp[i].kind),
+            sp[i].start, sp[i].len);
+  fprintf(out, "\n");
+}
+
+// --trivia: the listing, with each token's leading trivia on the line above
+// it and its trailing trivia on the line below, as kind@offset+length.
+static size_t emit_trivia_listing(Lexer *lx, FILE *out) {
+  size_t ntokens = 0;
+  print_listing_header(out);
+  while (1) {
+    TriviaToken tt;
+    next_trivia_token(lx, &tt);
+    Token t = token_from_raw(lx, &tt.tok);
+    ntokens++;
+    print_trivia(out, "leading", tt.leading, tt.nleading);
+    print_token(out, &t);
+    print_trivia(out, "trailing", tt.trailing, tt.ntrailing);
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+  }
+  return ntokens;
+}
+
+// Appends src[start, start + n) to buf[*len], unless that overruns cap.
+static int roundtrip_append(char *buf, size_t *len, size_t cap,
+                            const unsigned char *src, size_t start, size_t n) {
+  if (n > cap - *len)
+    return 0;
+  memcpy(buf + *len, src + start, n);
+  *len += n;
+  return 1;
+}
+
+// --roundtrip: writes the input back out from the tokens and their trivia,
+// as a formatter would, and compares it with the original. After an error
+// only the part before it can be rebuilt. Returns 1 on a mismatch.
+static int emit_roundtrip(Lexer *lx, FILE *out, size_t *ntokens) {
+  char *buf = arena_alloc(&lx->arena, lx->len + 1);
+  size_t n = 0;
+  int fits = 1;
+  TriviaToken tt;
+  *ntokens = 0;
+  do {
+    next_trivia_token(lx, &tt);
+    (*ntokens)++;
+    for (size_t i = 0; i < tt.nleading; i++)
+      fits &= roundtrip_append(buf, &n, lx->len, lx->src, tt.leading[i].start,
+                               tt.leading[i].len);
+    fits &= roundtrip_append(buf, &n, lx->len, lx->src, tt.tok.start,
+                             tt.tok.len);
+    for (size_t i = 0; i < tt.ntrailing; i++)
+      fits &= roundtrip_append(buf, &n, lx->len, lx->src,
+                               tt.trailing[i].start, tt.trailing[i].len);
+  } while (fits && tt.tok.type != TOK_EOF && tt.tok.type != TOK_ERROR);
+
+  size_t diff = 0;
+  while (diff < n && buf[diff] == (char)lx->src[diff])
+    diff++;
+  if (!fits || diff < n || (tt.tok.type == TOK_EOF && n != lx->len)) {
+    fprintf(out, "Round trip FAILED at byte %zu\n", diff);
+    return 1;
+  }
+  if (tt.tok.type == TOK_ERROR) {
+    fprintf(out, "Round trip OK up to the error: %zu of %zu bytes\n", n,
+            lx->len);
+    fprintf(out, "Stopped at error [%d:%d]: %s\n", tt.tok.line, tt.tok.col,
+            LEX_ERROR_MESSAGES[tt.tok.err]);
+  } else {
+    fprintf(out, "Round trip OK: %zu bytes\n", n);
+  }
+  return 0;
+}
+
+// Whether tokens a and b, written with nothing between them, would lex
+// differently: identifier characters running together, a number growing a
+// '.' or digits, or two operator bytes forming one operator or a comment.
+static int minify_needs_space(const Lexer *lx, const RawToken *a,
+                              const RawToken *b) {
+  unsigned char x = lx->src[a->start + a->len - 1], y = lx->src[b->start];
+  int number = a->type == TOK_INT || a->type == TOK_FLOAT;
+  if ((CHAR_CLASS[x] & CH_IDENT) && (CHAR_CLASS[y] & CH_IDENT))
+    return !number || (CHAR_CLASS[y] & CH_DIGIT); // "1" "x" stays apart
+  if (a->type == TOK_INT && y == '.')
+    return 1;
+  if (a->type == TOK_FLOAT && x == '.' && (CHAR_CLASS[y] & CH_DIGIT))
+    return 1;
+  if (a->type == TOK_OPERATOR && a->len == 1)
+    return operator_pair_kind(x, y) != KIND_NONE ||
+           (x == '/' && (y == '/' || y == '*'));
+  return 0;
+}
+
+// --minify: the source without comments and with whitespace cut down to
+// what keeps tokens apart. Tokens that touch in the source are copied as
+// one run with a single memcpy; only the gaps are decided token by token.
+// Preprocessor lines ('#' first on a line) keep their line breaks. After a
+// lexical error the rest of the input is copied unchanged.
+static size_t emit_minified(Lexer *lx, FILE *out, FILE *err) {
+  const unsigned char *s = lx->src;
+  char *buf = arena_alloc(&lx->arena, lx->len + 1); // never grows
+  size_t n = 0, ntokens = 0;
+  size_t run_start = 0, run_end = 0; // source bytes not yet copied
+  int directive = 0; // in a '#' line, whose end must stay a newline
+  RawToken a, b;
+
+  next_raw_token(lx, &b);
+  ntokens++;
+  run_start = run_end = b.start;
+  directive = s[b.start] == '#';
+  while (b.type != TOK_EOF && b.type != TOK_ERROR) {
+    a = b;
+    run_end = a.start + a.len;
+    next_raw_token(lx, &b);
+    ntokens++;
+    if (b.start == run_end || b.type == TOK_EOF)
+      continue; // no gap, or nothing more to separate
+
+    memcpy(buf + n, s + run_start, run_end - run_start);
+    n += run_end - run_start;
+    run_start = b.start;
+    int nl = (directive || s[b.start] == '#') &&
+             memchr(s + run_end, '\n', b.start - run_end);
+    if (nl)
+      buf[n++] = '\n';
+    else if (minify_needs_space(lx, &a, &b))
+      buf[n++] = ' ';
+    if (nl && !(a.len == 1 && s[a.start] == '\\')) // not a continuation
+      directive = s[b.start] == '#';
+  }
+
+  if (b.type == TOK_ERROR) {
+    run_end = lx->len;
+    fprintf(err, "Stopped at error [%d:%d]: %s (rest copied unchanged)\n",
+            b.line, b.col, LEX_ERROR_MESSAGES[b.err]);
+  }
+  memcpy(buf + n, s + run_start, run_end - run_start);
+  n += run_end - run_start;
+  fwrite(buf, 1, n, out);
+  return ntokens;
+}
+
+// One fingerprint line, "%016llx %d\n", formatted by hand: fprintf() took a
+// quarter of the time of the whole mode.
+static void print_fingerprint(FILE *out, const WinnowEntry *fp) {
+  char buf[40], *p = buf + 17;
+  for (int i = 0; i < 16; i++)
+    buf[i] = "0123456789abcdef"[(fp->hash >> (60 - 4 * i)) & 15];
+  buf[16] = ' ';
+  char digits[12];
+  int n = 0;
+  for (unsigned v = (unsigned)fp->line; n == 0 || v; v /= 10)
+    digits[n++] = (char)('0' + v % 10);
+  while (n)
+    *p++ = digits[--n];
+  *p++ = '\n';
+  fwrite(buf, 1, (size_t)(p - buf), out);
+}
+
+// --fingerprint: winnowed k-gram fingerprints of the file, one per line as
+// the hash and the line where its shingle starts, after a header naming the
+// parameters. Lexing, shingling and winnowing are one pass over raw tokens.
+static size_t emit_fingerprints(Lexer *lx, const LexOptions *opt, FILE *out,
+                                FILE *err) {
+  Shingler sh;
+  Winnower wn;
+  shingler_init(&sh, opt->kgram, &lx->arena);
+  winnow_init(&wn, opt->window, &lx->arena);
+  size_t ntokens = 0;
+  WinnowEntry fp;
+  RawToken t;
+  int line;
+
+  fprintf(out, "fingerprints k=%d w=%d\n", opt->kgram, opt->window);
+  while (1) {
+    next_raw_token(lx, &t);
+    ntokens++;
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+    if (shingler_push(&sh, shingle_value(lx, &t), t.line, &line) &&
+        winnow_push(&wn, shingle_mix(sh.h), line, &fp))
+      print_fingerprint(out, &fp);
+  }
+  if (winnow_finish(&wn, &fp))
+    print_fingerprint(out, &fp);
+  if (t.type == TOK_ERROR)
+    fprintf(err, "Stopped at error [%d:%d]: %s (fingerprints up to it)\n",
+            t.line, t.col, LEX_ERROR_MESSAGES[t.err]);
+  return ntokens;
+}
+
+// --fingerprint=DIR: the fingerprints of path go to DIR/<path>.fp, with '/'
+// and '%' in path written as %2F and %25 so every input gets its own file.
+static FILE *open_fingerprint_file(const char *dir, const char *path,
+                                   FILE *err) {
+  size_t n = strlen(dir) + 1 + 3 * strlen(path) + sizeof(".fp");
+  char *name = malloc(n), *p = name;
+  if (!name) {
+    perror("malloc");
+    exit(1);
+  }
+  p += sprintf(p, "%s/", dir);
+  for (const char *c = path; *c; c++) {
+    if (*c == '/' || *c == '%')
+      p += sprintf(p, "%%%02X", (unsigned char)*c);
+    else
+      *p++ = *c;
+  }
+  strcpy(p, ".fp");
+  FILE *fp = fopen(name, "w");
+  if (!fp)
+    fprintf(err, "%s: %s\n", name, strerror(errno));
+  free(name);
+  return fp;
+}
+
+// --minhash: the file's signature goes into opt->minhash; nothing is printed
+// per file. Only the signature and one shingle window are kept, whatever
+// the size of the file.
+static size_t minhash_file(Lexer *lx, const char *path, const LexOptions *opt,
+                           FILE *err) {
+  uint32_t sig[MINHASH_BINS];
+  Shingler sh;
+  RawToken t;
+  size_t ntokens = 0;
+  int line;
+
+  for (int i = 0; i < MINHASH_BINS; i++)
+    sig[i] = MINHASH_EMPTY;
+  shingler_init(&sh, opt->kgram, &lx->arena);
+  while (1) {
+    next_raw_token(lx, &t);
+    ntokens++;
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+    if (shingler_push(&sh, shingle_value(lx, &t), t.line, &line)) {
+      uint64_t h = shingle_mix(sh.h);
+      unsigned bin = (unsigned)(h >> (64 - MINHASH_BIN_BITS));
+      uint32_t v = (uint32_t)(h >> 1); // < MINHASH_EMPTY
+      if (v < sig[bin])
+        sig[bin] = v;
+    }
+  }
+  if (t.type == TOK_ERROR)
+    fprintf(err, "%s: stopped at error [%d:%d]: %s (signature up to it)\n",
+            path, t.line, t.col, LEX_ERROR_MESSAGES[t.err]);
+  if (minhash_densify(sig))
+    minhash_add(opt->minhash, path, sig);
+  return ntokens;
+}
+
+static int cmp_minhash_path(const void *a, const void *b) {
+  return strcmp(((const MinHashEntry *)a)->path,
+                ((const MinHashEntry *)b)->path);
+}
+
+static double minhash_similarity(const MinHashEntry *a, const MinHashEntry *b) {
+  int same = 0;
+  for (int i = 0; i < MINHASH_BINS; i++)
+    same += a->sig[i] == b->sig[i];
+  return (double)same / MINHASH_BINS;
+}
+
+// Rows per band: the largest r whose banding still finds a pair of
+// similarity threshold with probability MINHASH_RECALL, i.e. with
+// 1 - (1 - t^r)^b >= MINHASH_RECALL for b = MINHASH_BINS / r. Larger r means
+// fewer dissimilar pairs become candidates.
+static int minhash_rows(double threshold) {
+  int best = 1;
+  for (int r = 1; r <= MINHASH_BINS; r++) {
+    int b = MINHASH_BINS / r;
+    double tr = 1, miss = 1;
+    for (int i = 0; i < r; i++)
+      tr *= threshold;
+    for (int i = 0; i < b; i++)
+      miss *= 1 - tr;
+    if (1 - miss >= MINHASH_RECALL)
+      best = r;
+  }
+  return best;
+}
+
+typedef struct {
+  uint64_t key; // hash of one band of a signature
+  size_t file;
+} MinHashBucket;
+
+static int cmp_bucket(const void *a, const void *b) {
+  const MinHashBucket *x = a, *y = b;
+  if (x->key != y->key)
+    return x->key < y->key ? -1 : 1;
+  return x->file < y->file ? -1 : x->file > y->file;
+}
+
+static size_t uf_find(size_t *parent, size_t i) {
+  while (parent[i] != i)
+    i = parent[i] = parent[parent[i]];
+  return i;
+}
+
+// Groups the collected files and prints every group of two or more, each
+// member with its estimated similarity to the group's first file. Files
+// are sorted by path first, so the report does not depend on which worker
+// finished first.
+static void minhash_report(FILE *out, MinHashSet *ms) {
+  size_t n = ms->len;
+  int rows = minhash_rows(ms->threshold), bands = MINHASH_BINS / rows;
+  fprintf(out,
+          "Near-duplicate groups (similarity >= %.2f, %d bands x %d rows, "
+          "%zu files):\n",
+          ms->threshold, bands, rows, n);
+  if (n == 0) {
+    fprintf(out, "No near-duplicates found.\n");
+    return;
+  }
+  qsort(ms->items, n, sizeof(MinHashEntry), cmp_minhash_path);
+
+  size_t *parent = malloc((n + 1) * sizeof(size_t));
+  MinHashBucket *bk = malloc((n + 1) * sizeof(MinHashBucket));
+  if (!parent || !bk) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t i = 0; i < n; i++)
+    parent[i] = i;
+
+  // One band at a time, so the bucket array stays at n entries.
+  for (int band = 0; band < bands; band++) {
+    for (size_t i = 0; i < n; i++) {
+      uint64_t h = HASH_SEED ^ (uint64_t)band;
+      for (int r = 0; r < rows; r++)
+        h = hash_word(h, ms->items[i].sig[band * rows + r]);
+      bk[i] = (MinHashBucket){h, i};
+    }
+    qsort(bk, n, sizeof(MinHashBucket), cmp_bucket);
+    for (size_t lo = 0, hi; lo < n; lo = hi) {
+      for (hi = lo + 1; hi < n && bk[hi].key == bk[lo].key; hi++) {
+        size_t f = bk[hi].file;
+        for (size_t j = lo; j < hi; j++) { // a candidate pair per earlier file
+          size_t a = uf_find(parent, bk[j].file), b = uf_find(parent, f);
+          if (a == b)
+            break;
+          if (minhash_similarity(&ms->items[bk[j].file], &ms->items[f]) >=
+              ms->threshold) {
+            parent[a > b ? a : b] = a < b ? a : b; // root is the first path
+            break;
+          }
+        }
+      }
+    }
+  }
+
+  // Members of each group in path order: next[i] follows i in its group.
+  size_t *size = calloc(n + 1, sizeof(size_t));
+  size_t *next = malloc((n + 1) * sizeof(size_t));
+  if (!size || !next) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t i = n; i-- > 0;) {
+    size_t root = uf_find(parent, i);
+    next[i] = size[root]++ ? next[root] : SIZE_MAX;
+    if (i != root)
+      next[root] = i;
+  }
+
+  size_t ngroups = 0;
+  for (size_t i = 0; i < n; i++) {
+    if (parent[i] != i || size[i] < 2)
+      continue;
+    fprintf(out, "Group %zu (%zu files):\n", ++ngroups, size[i]);
+    fprintf(out, "  %s\n", ms->items[i].path);
+    for (size_t j = next[i]; j != SIZE_MAX; j = next[j])
+      fprintf(out, "  %s  %.2f\n", ms->items[j].path,
+              minhash_similarity(&ms->items[i], &ms->items[j]));
+  }
+  if (ngroups == 0)
+    fprintf(out, "No near-duplicates found.\n");
+  free(next);
+  free(size);
+  free(bk);
+  free(parent);
+}
+
+// Lexes one file, writing the listing to out and reports/diagnostics to err.
+// lx is the calling thread's Lexer, reused from file to file: the input and
+// all lexemes live in its arena, which is reset here. perf is the calling
+// thread's counter set (NULL when --perf is off).
+static int lex_file(Lexer *lx, const char *path, const LexOptions *opt,
+                    PerfCounters *perf, FILE *out, FILE *err) {
+#if LEXER_STATS
+  double wall_start = opt->stats ? now_seconds() : 0;
+#endif
+  lexer_reset(lx);
+  size_t len;
+  char *src = read_file(path, &lx->arena, &len, err);
+  if (!src)
+    return 1;
+
+  if (opt->skip_binary &&
+      memchr(src, '\0', len < BINARY_PROBE_LEN ? len : BINARY_PROBE_LEN)) {
+    fprintf(err, "Skipping binary file: %s\n", path);
+    return 0;
+  }
+
+  lexer_set_input(lx, src, len);
+  lx->type_mask = opt->only;
+  lx->interner = opt->interner;
+  if (lex_use_index && !opt->stats && !opt->trivia && !opt->roundtrip &&
+      !(opt->only & (1u << TOK_COMMENT)))
+    lexer_build_index(lx);
+#if LEXER_STATS
+  LexStats st;
+  lx->stats = NULL;
+  if (opt->stats) {
+    memset(&st, 0, sizeof(st));
+    lx->stats = &st;
+  }
+#endif
+
+  FILE *fp_out = NULL;
+  if (opt->fingerprint_dir) {
+    fp_out = open_fingerprint_file(opt->fingerprint_dir, path, err);
+    if (!fp_out)
+      return 1;
+  } else if (opt->multi_file && !opt->minhash) {
+    fprintf(out, "File: %s\n", path);
+  }
+
+  size_t ntokens;
+  int rc = 0;
+  if (perf)
+    perf_start(perf);
+  if (opt->roundtrip)
+    rc = emit_roundtrip(lx, out, &ntokens);
+  else if (opt->trivia)
+    ntokens = emit_trivia_listing(lx, out);
+  else if (opt->minify)
+    ntokens = emit_minified(lx, out, err);
+  else if (opt->fingerprint)
+    ntokens = emit_fingerprints(lx, opt, fp_out ? fp_out : out, err);
+  else if (opt->minhash)
+    ntokens = minhash_file(lx, path, opt, err);
+  else if (opt->count)
+    ntokens = emit_counts(lx, out);
+  else
+    ntokens = emit_listing(lx, out);
+  if (perf) {
+    perf_stop(perf);
+    fflush(out);
+    print_perf(err, path, perf, len, ntokens);
+  }
+
+  if (fp_out && fclose(fp_out) != 0) {
+    fprintf(err, "%s: fingerprints: %s\n", path, strerror(errno));
+    rc = 1;
+  }
+
+#if LEXER_STATS
+  if (opt->stats) {
+    double wall = now_seconds() - wall_start;
+    fflush(out);
+    print_stats(err, path, &st, wall);
+    lx->stats = NULL;
+  }
+#endif
+
+  return rc;
+}
+
+/* ---------- Path lists ---------- */
+typedef struct {
+  char **items;
+  size_t len;
+  size_t cap;
+} PathList;
+
+static void pl_push(PathList *l, char *path) {
+  if (l->len == l->cap) {
+    size_t cap = l->cap ? l->cap * 2 : 64;
+    char **p = realloc(l->items, cap * sizeof(*p));
+    if (!p) {
+      perror("realloc");
+      exit(1);
+    }
+    l->items = p;
+    l->cap = cap;
+  }
+  l->items[l->len++] = path;
+}
+
+static void pl_append(PathList *dst, PathList *src) {
+  for (size_t i = 0; i < src->len; i++)
+    pl_push(dst, src->items[i]);
+  src->len = 0;
+}
+
+static void pl_free(PathList *l) {
+  for (size_t i = 0; i < l->len; i++)
+    free(l->items[i]);
+  free(l->items);
+  memset(l, 0, sizeof(*l));
+}
+
+static int cmp_path(const void *a, const void *b) {
+  return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+static char *join_path(const char *dir, const char *name) {
+  size_t dl = strlen(dir), nl = strlen(name);
+  int slash = dl > 0 && dir[dl - 1] != '/';
+  char *p = malloc(dl + (size_t)slash + nl + 1);
+  if (!p) {
+    perror("malloc");
+    exit(1);
+  }
+  memcpy(p, dir, dl);
+  if (slash)
+    p[dl] = '/';
+  memcpy(p + dl + (size_t)slash, name, nl + 1);
+  return p;
+}
+
+/* ---------- Parallel directory walk ---------- */
+// Workers share a stack of directories still to be read. A worker that finds
+// the stack empty waits until either another worker pushes subdirectories or
+// nobody is reading anymore, which means the walk is complete.
+typedef struct {
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  PathList pending; // directories not yet read
+  PathList files;   // matching regular files
+  int busy;         // workers currently reading a directory
+  const char *exts; // comma-separated suffixes, NULL = every file
+} DirWalk;
+
+static int has_wanted_ext(const char *name, const char *exts) {
+  if (!exts)
+    return 1;
+  size_t n = strlen(name);
+  const char *p = exts;
+  while (*p) {
+    const char *end = strchr(p, ',');
+    size_t len = end ? (size_t)(end - p) : strlen(p);
+    if (len > 0 && len <= n && strncmp(name + n - len, p, len) == 0)
+      return 1;
+    if (!end)
+      break;
+    p = end + 1;
+  }
+  return 0;
+}
+
+// Symlinks are not followed, as with find(1) by default.
+static void walk_one_dir(DirWalk *w, const char *dir, PathList *subdirs,
+                         PathList *files) {
+  DIR *d = opendir(dir);
+  if (!d) {
+    fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+    return;
+  }
+  struct dirent *e;
+  while ((e = readdir(d)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    int is_dir = 0, is_reg = 0;
+    char *path = join_path(dir, e->d_name);
+#ifdef DT_DIR
+    is_dir = e->d_type == DT_DIR;
+    is_reg = e->d_type == DT_REG;
+    if (e->d_type == DT_UNKNOWN)
+#endif
+    {
+      struct stat st;
+      if (lstat(path, &st) == 0) {
+        is_dir = S_ISDIR(st.st_mode);
+        is_reg = S_ISREG(st.st_mode);
+      }
+    }
+    if (is_dir)
+      pl_push(subdirs, path);
+    else if (is_reg && has_wanted_ext(e->d_name, w->exts))
+      pl_push(files, path);
+    else
+      free(path);
+  }
+  closedir(d);
+}
+
+static void *dir_walk_worker(void *arg) {
+  DirWalk *w = arg;
+  PathList subdirs = {0}, files = {0};
+
+  pthread_mutex_lock(&w->lock);
+  while (1) {
+    while (w->pending.len == 0 && w->busy > 0)
+      pthread_cond_wait(&w->cond, &w->lock);
+    if (w->pending.len == 0)
+      break; // nothing queued and nobody can queue more
+    char *dir = w->pending.items[--w->pending.len];
+    w->busy++;
+    pthread_mutex_unlock(&w->lock);
+
+    walk_one_dir(w, dir, &subdirs, &files);
+    free(dir);
+
+    pthread_mutex_lock(&w->lock);
+    pl_append(&w->pending, &subdirs);
+    pl_append(&w->files, &files);
+    w->busy--;
+    pthread_cond_broadcast(&w->cond);
+  }
+  pthread_mutex_unlock(&w->lock);
+
+  free(subdirs.items);
+  free(files.items);
+  return NULL;
+}
+
+// Appends every matching file under the roots to out, in sorted path order.
+static void walk_dirs(char **roots, int nroots, const char *exts, int jobs,
+                      PathList *out) {
+  DirWalk w;
+  memset(&w, 0, sizeof(w));
+  pthread_mutex_init(&w.lock, NULL);
+  pthread_cond_init(&w.cond, NULL);
+  w.exts = exts;
+  for (int i = 0; i < nroots; i++)
+    pl_push(&w.pending, join_path(roots[i], ""));
+
+  pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)jobs);
+  int started = 0;
+  for (int i = 0; tids && i < jobs; i++) {
+    if (pthread_create(&tids[i], NULL, dir_walk_worker, &w) != 0)
+      break;
+    started++;
+  }
+  if (started == 0)
+    dir_walk_worker(&w);
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  free(tids);
+
+  if (w.files.len > 0) // items is NULL when nothing was found
+    qsort(w.files.items, w.files.len, sizeof(char *), cmp_path);
+  pl_append(out, &w.files);
+  free(w.files.items);
+  free(w.pending.items);
+  pthread_cond_destroy(&w.cond);
+  pthread_mutex_destroy(&w.lock);
+}
+
+/* ---------- Duplicate contents (--dedupe) ---------- */
+// Vendored trees often hold many byte-identical copies of a file. Before
+// lexing, every file is read once in fixed-size chunks and hashed. Files
+// with the same hash and length are then compared byte for byte with the
+// first of them in input order, since the hash is not collision resistant;
+// only that first file is lexed and the copies reuse its output. Hashing
+// runs at memory speed, so this costs little when nothing is duplicated.
+#define DEDUPE_CHUNK (1 << 16)
+
+typedef struct {
+  uint64_t hash;
+  size_t len; // bytes, or SIZE_MAX if unreadable or skipped as binary
+  size_t file;
+} DedupeKey;
+
+typedef struct {
+  size_t owner; // first file with the same contents (itself if none)
+  size_t len;
+} FileDedupe;
+
+typedef struct {
+  char **paths;
+  size_t n;
+  int skip_binary;
+  DedupeKey *keys; // indexed by file
+  size_t next;     // next file to claim
+  pthread_mutex_t lock;
+} DedupeScan;
+
+// Reads one file in chunks and hashes it. Errors are left for the lexing
+// pass to report.
+static void dedupe_hash_file(DedupeKey *k, const char *path, int skip_binary,
+                             unsigned char *chunk) {
+  k->len = SIZE_MAX;
+  FILE *fp = fopen(path, "rb");
+  if (!fp)
+    return;
+  uint64_t h = HASH_SEED;
+  size_t len = 0, got;
+  do {
+    got = fread(chunk, 1, DEDUPE_CHUNK, fp);
+    if (skip_binary && len < BINARY_PROBE_LEN &&
+        memchr(chunk, '\0',
+               got < BINARY_PROBE_LEN - len ? got : BINARY_PROBE_LEN - len)) {
+      fclose(fp);
+      return; // lexed, that is skipped, on its own
+    }
+    h = hash_word(h, lex_hash64(chunk, got));
+    len += got;
+  } while (got == DEDUPE_CHUNK);
+  if (!ferror(fp)) {
+    k->hash = h;
+    k->len = len;
+  }
+  fclose(fp);
+}
+
+static void *dedupe_worker(void *arg) {
+  DedupeScan *ds = arg;
+  unsigned char *chunk = calloc(1, DEDUPE_CHUNK + LEX_PAD); // lex_hash64 pad
+  if (!chunk) {
+    perror("malloc");
+    exit(1);
+  }
+  while (1) {
+    pthread_mutex_lock(&ds->lock);
+    size_t i = ds->next++;
+    pthread_mutex_unlock(&ds->lock);
+    if (i >= ds->n)
+      break;
+    ds->keys[i].file = i;
+    dedupe_hash_file(&ds->keys[i], ds->paths[i], ds->skip_binary, chunk);
+  }
+  free(chunk);
+  return NULL;
+}
+
+// Whether the files at a and b hold the same bytes, read chunk by chunk
+// into the two buffers. Unreadable files are never the same.
+static int dedupe_same_contents(const char *a, const char *b,
+                                unsigned char *buf_a, unsigned char *buf_b) {
+  FILE *fa = fopen(a, "rb");
+  FILE *fb = fa ? fopen(b, "rb") : NULL;
+  int same = fb != NULL;
+  while (same) {
+    size_t na = fread(buf_a, 1, DEDUPE_CHUNK, fa);
+    size_t nb = fread(buf_b, 1, DEDUPE_CHUNK, fb);
+    if (na != nb || memcmp(buf_a, buf_b, na) != 0 || ferror(fa) || ferror(fb))
+      same = 0;
+    else if (na < DEDUPE_CHUNK)
+      break;
+  }
+  if (fb)
+    fclose(fb);
+  if (fa)
+    fclose(fa);
+  return same;
+}
+
+static int cmp_dedupe_key(const void *a, const void *b) {
+  const DedupeKey *x = a, *y = b;
+  if (x->hash != y->hash)
+    return x->hash < y->hash ? -1 : 1;
+  if (x->len != y->len)
+    return x->len < y->len ? -1 : 1;
+  return x->file < y->file ? -1 : x->file > y->file;
+}
+
+// Hashes all files with up to jobs threads and returns, per file, the file
+// whose output it can reuse. The caller frees the result.
+static FileDedupe *dedupe_files(char **paths, size_t n, int skip_binary,
+                                int jobs) {
+  DedupeScan ds;
+  memset(&ds, 0, sizeof(ds));
+  ds.paths = paths;
+  ds.n = n;
+  ds.skip_binary = skip_binary;
+  ds.keys = malloc(n * sizeof(DedupeKey));
+  FileDedupe *files = malloc(n * sizeof(FileDedupe));
+  pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)jobs);
+  if (!ds.keys || !files || !tids) {
+    perror("malloc");
+    exit(1);
+  }
+  pthread_mutex_init(&ds.lock, NULL);
+
+  int started = 0;
+  for (int i = 0; i < jobs - 1; i++) {
+    if (pthread_create(&tids[i], NULL, dedupe_worker, &ds) != 0)
+      break;
+    started++;
+  }
+  dedupe_worker(&ds); // the calling thread helps
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&ds.lock);
+
+  for (size_t i = 0; i < n; i++)
+    files[i] = (FileDedupe){i, ds.keys[i].len};
+  qsort(ds.keys, n, sizeof(DedupeKey), cmp_dedupe_key);
+
+  // Within each run of equal hash and length, in input order, a file joins
+  // the first earlier owner whose bytes it matches, or owns its own output.
+  // Heads collects the owners of the current run; on a collision it holds
+  // more than one.
+  unsigned char *buf_a = malloc(DEDUPE_CHUNK), *buf_b = malloc(DEDUPE_CHUNK);
+  size_t *heads = malloc((n + 1) * sizeof(size_t));
+  if (!buf_a || !buf_b || !heads) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t lo = 0, hi; lo < n; lo = hi) {
+    const DedupeKey *first = &ds.keys[lo];
+    for (hi = lo + 1; hi < n && ds.keys[hi].hash == first->hash &&
+                      ds.keys[hi].len == first->len;
+         hi++)
+      ;
+    if (first->len == SIZE_MAX)
+      continue;
+    size_t nheads = 0;
+    heads[nheads++] = first->file;
+    for (size_t i = lo + 1; i < hi; i++) {
+      size_t f = ds.keys[i].file, h = 0;
+      while (h < nheads &&
+             !dedupe_same_contents(paths[heads[h]], paths[f], buf_a, buf_b))
+        h++;
+      if (h < nheads)
+        files[f].owner = heads[h];
+      else
+        heads[nheads++] = f;
+    }
+  }
+  free(heads);
+  free(buf_b);
+  free(buf_a);
+  free(tids);
+  free(ds.keys);
+  return files;
+}
+
+// --dedupe: files that were not lexed get their owner's signature, if it
+// has one.
+static void minhash_add_duplicates(MinHashSet *ms, char **paths,
+                                   const FileDedupe *dedupe, size_t n) {
+  size_t lexed = ms->len;
+  qsort(ms->items, lexed, sizeof(MinHashEntry), cmp_minhash_path);
+  for (size_t i = 0; i < n; i++) {
+    if (dedupe[i].owner == i)
+      continue;
+    MinHashEntry key = {.path = paths[dedupe[i].owner]};
+    MinHashEntry *e =
+        bsearch(&key, ms->items, lexed, sizeof(MinHashEntry), cmp_minhash_path);
+    if (e) {
+      uint32_t sig[MINHASH_BINS];
+      memcpy(sig, e->sig, sizeof(sig)); // minhash_add() may move items
+      minhash_add(ms, paths[i], sig);
+    }
+  }
+}
+
+/* ---------- Batch mode ---------- */
+// Files are claimed in order by a pool of workers. Each listing is rendered
+// into memory and the main thread writes them out in input order as soon as
+// the next one is finished.
+typedef struct {
+  char *out;
+  size_t out_len;
+  char *err;
+  size_t err_len;
+  int rc;
+  int done;
+  size_t dups; // --dedupe: duplicates still to be written from out
+} BatchResult;
+
+typedef struct {
+  char **paths;
+  size_t n;
+  const LexOptions *opt;
+  const FileDedupe *dedupe; // --dedupe, else NULL
+  BatchResult *results;
+  size_t next; // next file to claim
+  pthread_mutex_t lock;
+  pthread_cond_t cond; // signalled whenever a result is done
+} Batch;
+
+static void *batch_worker(void *arg) {
+  Batch *b = arg;
+  PerfCounters perf, *pc = NULL;
+  if (b->opt->perf && perf_open(&perf, 0) > 0)
+    pc = &perf;
+  Lexer lx;
+  lexer_init(&lx);
+
+  while (1) {
+    pthread_mutex_lock(&b->lock);
+    size_t i = b->next++;
+    pthread_mutex_unlock(&b->lock);
+    if (i >= b->n)
+      break;
+
+    BatchResult *r = &b->results[i];
+    int dup = b->dedupe && b->dedupe[i].owner != i; // written from the owner's
+    FILE *out = dup ? NULL : open_memstream(&r->out, &r->out_len);
+    FILE *err = dup ? NULL : open_memstream(&r->err, &r->err_len);
+    if (dup) {
+      // nothing to lex
+    } else if (out && err) {
+      r->rc = lex_file(&lx, b->paths[i], b->opt, pc, out, err);
+    } else {
+      fprintf(stderr, "%s: open_memstream: %s\n", b->paths[i],
+              strerror(errno));
+      r->rc = 1;
+    }
+    if (out)
+      fclose(out);
+    if (err)
+      fclose(err);
+
+    pthread_mutex_lock(&b->lock);
+    r->done = 1;
+    pthread_cond_broadcast(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+  }
+
+  lexer_free(&lx);
+  if (pc)
+    perf_close(pc);
+  return NULL;
+}
+
+static int run_batch(char **paths, size_t n, const LexOptions *opt, int jobs) {
+  int rc = 0;
+  if (jobs > (int)n)
+    jobs = (int)n;
+
+  if (jobs <= 1 && !opt->dedupe) {
+    PerfCounters perf, *pc = NULL;
+    if (opt->perf && perf_open(&perf, 0) > 0)
+      pc = &perf;
+    Lexer lx;
+    lexer_init(&lx);
+    for (size_t i = 0; i < n; i++) {
+      if (lex_file(&lx, paths[i], opt, pc, stdout, stderr) != 0)
+        rc = 1;
+    }
+    lexer_free(&lx);
+    if (pc)
+      perf_close(pc);
+    return rc;
+  }
+
+  Batch b;
+  memset(&b, 0, sizeof(b));
+  b.paths = paths;
+  b.n = n;
+  b.opt = opt;
+  b.results = calloc(n, sizeof(BatchResult));
+  pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)jobs);
+  if (!b.results || !tids) {
+    perror("malloc");
+    free(b.results);
+    free(tids);
+    return 1;
+  }
+  pthread_mutex_init(&b.lock, NULL);
+  pthread_cond_init(&b.cond, NULL);
+  FileDedupe *dedupe = NULL;
+  size_t ndups = 0, dup_bytes = 0;
+  if (opt->dedupe) {
+    b.dedupe = dedupe = dedupe_files(paths, n, opt->skip_binary, jobs);
+    for (size_t i = 0; i < n; i++) {
+      if (dedupe[i].owner != i)
+        b.results[dedupe[i].owner].dups++;
+    }
+  }
+
+  int started = 0;
+  for (int i = 0; i < jobs; i++) {
+    if (pthread_create(&tids[i], NULL, batch_worker, &b) != 0)
+      break;
+    started++;
+  }
+  if (started == 0) // no threads available: do the work here
+    batch_worker(&b);
+
+  for (size_t i = 0; i < n; i++) {
+    BatchResult *r = &b.results[i];
+    pthread_mutex_lock(&b.lock);
+    while (!r->done)
+      pthread_cond_wait(&b.cond, &b.lock);
+    pthread_mutex_unlock(&b.lock);
+
+    size_t owner = dedupe ? dedupe[i].owner : i;
+    if (owner != i) {
+      // The owner's output under this file's name. In multi-file runs a
+      // non-empty output starts with the owner's "File:" line.
+      BatchResult *o = &b.results[owner];
+      size_t skip = 0;
+      if (opt->multi_file && o->out_len) {
+        skip = strlen("File: \n") + strlen(paths[owner]);
+        printf("File: %s\n", paths[i]);
+      }
+      fwrite(o->out + skip, 1, o->out_len - skip, stdout);
+      if (opt->stats) {
+        fflush(stdout);
+        fprintf(stderr, "Stats for %s: same contents as %s, %zu bytes not "
+                        "lexed\n", paths[i], paths[owner], dedupe[i].len);
+      }
+      ndups++;
+      dup_bytes += dedupe[i].len;
+      r->rc = o->rc;
+      if (--o->dups == 0)
+        free(o->out);
+    } else {
+      fwrite(r->out, 1, r->out_len, stdout);
+      if (r->err_len) {
+        fflush(stdout);
+        fwrite(r->err, 1, r->err_len, stderr);
+      }
+      if (r->dups == 0) // else kept for the duplicates
+        free(r->out);
+      free(r->err);
+    }
+    if (r->rc != 0)
+      rc = 1;
+  }
+  if (dedupe && opt->minhash)
+    minhash_add_duplicates(opt->minhash, paths, dedupe, n);
+  if (dedupe && opt->stats)
+    fprintf(stderr, "Dedupe: %zu of %zu files were duplicates, %zu bytes not "
+                    "lexed\n", ndups, n, dup_bytes);
+
+  for (int i = 0; i < started; i++)
+    pthread_join(tids[i], NULL);
+  pthread_cond_destroy(&b.cond);
+  pthread_mutex_destroy(&b.lock);
+  free(dedupe);
+  free(tids);
+  free(b.results);
+  return rc;
+}
+
+/* ---------- Pipelined mode ---------- */
+// --pipeline: reading, lexing and formatting each get a thread. Filled chunks
+// travel reader -> lexer and token batches lexer -> writer over
+// single-producer/single-consumer rings, and come back empty over a second
+// ring each. Both pools are fixed, so a stage that falls behind stalls the
+// one feeding it instead of letting buffers pile up.
+#define PIPE_CHUNK_SIZE (64 * 1024)
+#define PIPE_CHUNKS 8
+#define PIPE_BATCH_TOKENS 1024
+#define PIPE_BATCHES 8
+#define PIPE_MAX_TOKEN (1024 * 1024) // longest token carried across chunks
+#define RING_CAP 16 // power of two, at least the size of either pool
+
+typedef struct {
+  void *slot[RING_CAP];
+  _Alignas(64) atomic_size_t head; // next slot to pop, owned by the consumer
+  _Alignas(64) atomic_size_t tail; // next slot to push, owned by the producer
+} SpscRing;
+
+static void ring_init(SpscRing *q) {
+  atomic_init(&q->head, 0);
+  atomic_init(&q->tail, 0);
+}
+
+// Called while a ring is empty (or full): yield at first, then sleep so a
+// stage stalled on a slow consumer does not burn a core.
+static void ring_backoff(unsigned *spins) {
+  if (++*spins < 64) {
+    sched_yield();
+    return;
+  }
+  struct timespec ts = {0, 100000}; // 0.1 ms
+  nanosleep(&ts, NULL);
+}
+
+static void ring_push(SpscRing *q, void *item) {
+  size_t tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+  unsigned spins = 0;
+  while (tail - atomic_load_explicit(&q->head, memory_order_acquire) ==
+         RING_CAP)
+    ring_backoff(&spins);
+  q->slot[tail % RING_CAP] = item;
+  atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+}
+
+static void *ring_pop(SpscRing *q) {
+  size_t head = atomic_load_explicit(&q->head, memory_order_relaxed);
+  unsigned spins = 0;
+  while (atomic_load_explicit(&q->tail, memory_order_acquire) == head)
+    ring_backoff(&spins);
+  void *item = q->slot[head % RING_CAP];
+  atomic_store_explicit(&q->head, head + 1, memory_order_release);
+  return item;
+}
+
+typedef struct {
+  size_t len;
+  int last; // nothing follows: end of input, read error or stop request
+  int err;  // errno of a failed read, 0 otherwise
+  unsigned char data[PIPE_CHUNK_SIZE];
+} PipeChunk;
+
+typedef struct {
+  Token tokens[PIPE_BATCH_TOKENS];
+  size_t n;
+  Arena arena; // lexemes of tokens[], reset each time the batch is refilled
+  int last;    // final batch of the input
+} PipeBatch;
+
+typedef struct {
+  FILE *in;
+  const LexOptions *opt;
+  SpscRing chunks, free_chunks;   // reader -> lexer, lexer -> reader
+  SpscRing batches, free_batches; // lexer -> writer, writer -> lexer
+  atomic_int stop;                // the lexer wants no more input
+  PipeChunk *chunk_pool;
+  PipeBatch *batch_pool;
+  // Written by the lexer thread before it sends the last batch.
+  int read_err;
+  int skipped; // --dir: binary file
+  size_t counts[TOKEN_TYPE_COUNT];
+  size_t lines;
+  RawToken last; // EOF or the error that stopped lexing
+  int too_long;  // a token outgrew PIPE_MAX_TOKEN, starting at:
+  int long_line;
+  int long_col;
+} Pipeline;
+
+static void *pipe_reader(void *arg) {
+  Pipeline *pp = arg;
+  int last = 0;
+  while (!last) {
+    PipeChunk *c = ring_pop(&pp->free_chunks);
+    c->len = 0;
+    c->err = 0;
+    if (!atomic_load(&pp->stop)) {
+      c->len = fread(c->data, 1, PIPE_CHUNK_SIZE, pp->in);
+      if (ferror(pp->in))
+        c->err = errno ? errno : EIO;
+    }
+    last = c->len < PIPE_CHUNK_SIZE;
+    c->last = last;
+    ring_push(&pp->chunks, c);
+  }
+  return NULL;
+}
+
+// A comment still open at the end of the window. It is consumed chunk by
+// chunk as input arrives instead of being carried, however long it is.
+typedef enum {
+  PIPE_NO_COMMENT,
+  PIPE_LINE_COMMENT,
+  PIPE_BLOCK_COMMENT
+} PipeCommentKind;
+
+typedef struct {
+  PipeCommentKind kind;
+  int star; // block comment: the last byte seen was a '*' of its body
+} PipeComment;
+
+// Finds the comment left open by trivia that ran from p to the end of the
+// window. The scan has already counted its newlines; this only locates it.
+static PipeComment pipe_open_comment(const Lexer *lx, size_t p) {
+  const unsigned char *s = lx->src;
+  PipeComment pc = {PIPE_NO_COMMENT, 0};
+  while (p < lx->len) {
+    if (CHAR_CLASS[s[p]] & CH_SPACE) {
+      p++;
+    } else if (s[p] == '/' && s[p + 1] == '/') {
+      const unsigned char *nl = memchr(s + p + 2, '\n', lx->len - (p + 2));
+      if (!nl) {
+        pc.kind = PIPE_LINE_COMMENT;
+        break;
+      }
+      p = (size_t)(nl - s);
+    } else if (s[p] == '/' && s[p + 1] == '*') {
+      size_t q = p + 2;
+      while (q < lx->len && !(s[q] == '*' && s[q + 1] == '/'))
+        q++;
+      if (q >= lx->len) {
+        pc.kind = PIPE_BLOCK_COMMENT;
+        pc.star = lx->len > p + 2 && s[lx->len - 1] == '*';
+        break;
+      }
+      p = q + 2;
+    } else {
+      break;
+    }
+  }
+  return pc;
+}
+
+// Consumes the rest of an open comment from lx->pos, up to the end of the
+// window if it does not close there.
+static void pipe_skip_open_comment(Lexer *lx, PipeComment *pc) {
+  const unsigned char *s = lx->src;
+  size_t p = lx->pos;
+  if (pc->kind == PIPE_LINE_COMMENT) {
+    const unsigned char *nl = memchr(s + p, '\n', lx->len - p);
+    if (nl)
+      pc->kind = PIPE_NO_COMMENT; // the newline is left for the lexer
+    p = nl ? (size_t)(nl - s) : lx->len;
+  } else {
+    for (; p < lx->len; p++) {
+      if (pc->star && s[p] == '/') {
+        pc->kind = PIPE_NO_COMMENT;
+        pc->star = 0;
+        p++;
+        break;
+      }
+      pc->star = s[p] == '*';
+      if (s[p] == '\n')
+        lexer_newline(lx, p);
+    }
+  }
+  lx->pos = p;
+}
+
+// Lexes a sliding window: each chunk is appended to the unfinished tail of
+// the previous one. A token is only taken once a byte of real input follows
+// it; one touching the end of the window (a name or number that may go on,
+// an unterminated string) is rescanned with the next chunk. Trailing
+// whitespace and comments are consumed right away, so the tail never holds
+// more than one token, and memory stays bounded by PIPE_MAX_TOKEN whatever
+// the input size.
+static void *pipe_lexer(void *arg) {
+  Pipeline *pp = arg;
+  const LexOptions *opt = pp->opt;
+  Lexer lx;
+  lexer_init(&lx);
+  lexer_set_input(&lx, NULL, 0);
+  lx.type_mask = opt->only;
+  lx.interner = opt->interner;
+
+  unsigned char *win = NULL;
+  size_t win_len = 0, win_cap = 0, total = 0;
+  unsigned char last_byte = 0;
+  int last = 0, done = 0, first = 1;
+  PipeBatch *b = NULL;
+  PipeComment comment = {PIPE_NO_COMMENT, 0};
+  RawToken r = {0};
+  r.type = TOK_EOF;
+
+  while (!last) {
+    PipeChunk *c = ring_pop(&pp->chunks);
+    last = c->last;
+    if (c->err)
+      pp->read_err = c->err;
+    total += c->len;
+    if (c->len)
+      last_byte = c->data[c->len - 1];
+    if (first && opt->skip_binary &&
+        memchr(c->data, '\0',
+               c->len < BINARY_PROBE_LEN ? c->len : BINARY_PROBE_LEN)) {
+      pp->skipped = 1;
+      done = 1;
+    }
+    first = 0;
+    if (pp->read_err)
+      done = 1;
+    if (done) { // draining: --count still wants the last byte
+      if (!opt->count || pp->skipped || pp->read_err || pp->too_long)
+        atomic_store(&pp->stop, 1);
+      ring_push(&pp->free_chunks, c);
+      continue;
+    }
+
+    if (win_len + c->len + LEX_PAD > win_cap) {
+      win_cap = (win_len + c->len + LEX_PAD) * 2;
+      win = realloc(win, win_cap);
+      if (!win) {
+        perror("realloc");
+        exit(1);
+      }
+    }
+    memcpy(win + win_len, c->data, c->len);
+    win_len += c->len;
+    memset(win + win_len, 0, LEX_PAD);
+    ring_push(&pp->free_chunks, c);
+    lx.src = win;
+    lx.len = win_len;
+    if (comment.kind != PIPE_NO_COMMENT)
+      pipe_skip_open_comment(&lx, &comment);
+    if (last) // an unterminated comment simply ends with the input
+      comment.kind = PIPE_NO_COMMENT;
+
+    // The type mask is applied here rather than by next_wanted_raw_token(),
+    // so that skipped tokens get the same end-of-window check.
+    while (comment.kind == PIPE_NO_COMMENT) {
+      size_t trivia = lx.pos;
+      skip_whitespace_and_comments(&lx);
+      size_t start = lx.pos, line_start = lx.line_start;
+      int line = lx.line;
+      next_raw_token(&lx, &r);
+      if (!last && r.type == TOK_EOF) {
+        comment = pipe_open_comment(&lx, trivia);
+        break;
+      }
+      if (!last && lx.pos + 1 >= lx.len) {
+        lx.pos = start;
+        lx.line_start = line_start;
+        lx.line = line;
+        break;
+      }
+      if (!((lx.type_mask >> r.type) & 1u))
+        continue;
+      if (opt->count) {
+        pp->counts[r.type]++;
+      } else {
+        if (!b) {
+          b = ring_pop(&pp->free_batches);
+          b->n = 0;
+          arena_reset(&b->arena);
+          lx.arena = b->arena; // lexemes go straight into the batch
+        }
+        b->tokens[b->n++] = token_from_raw(&lx, &r);
+        if (b->n == PIPE_BATCH_TOKENS) {
+          b->arena = lx.arena;
+          ring_push(&pp->batches, b);
+          b = NULL;
+        }
+      }
+      if (r.type == TOK_EOF || r.type == TOK_ERROR) {
+        done = 1;
+        break;
+      }
+    }
+
+    // Keep the unfinished tail. line_start may lie before the cut; unsigned
+    // wraparound still yields the right columns.
+    memmove(win, win + lx.pos, win_len - lx.pos);
+    win_len -= lx.pos;
+    lx.line_start -= lx.pos;
+    lx.pos = 0;
+    if (!done && win_len > PIPE_MAX_TOKEN) {
+      pp->too_long = 1;
+      pp->long_line = lx.line;
+      pp->long_col = lexer_col(&lx, 0);
+      done = 1;
+    }
+  }
+
+  pp->lines = (size_t)lx.line;
+  if (total == 0 || last_byte == '\n')
+    pp->lines--; // no partial last line
+  pp->last = r;
+  if (b) {
+    b->arena = lx.arena;
+  } else {
+    b = ring_pop(&pp->free_batches);
+    b->n = 0;
+  }
+  b->last = 1;
+  ring_push(&pp->batches, b);
+  free(win);
+  // lx.arena only aliases batch arenas, which the pool frees.
+  return NULL;
+}
+
+// Lexes one file through the pipeline; the calling thread is the writer.
+// "-" reads standard input.
+static int run_pipeline(const char *path, const LexOptions *opt, FILE *out) {
+  int is_stdin = strcmp(path, "-") == 0;
+  FILE *in = is_stdin ? stdin : fopen(path, "rb");
+  if (is_stdin)
+    path = "<stdin>";
+  if (!in) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  Pipeline pp;
+  memset(&pp, 0, sizeof(pp));
+  pp.in = in;
+  pp.opt = opt;
+  ring_init(&pp.chunks);
+  ring_init(&pp.free_chunks);
+  ring_init(&pp.batches);
+  ring_init(&pp.free_batches);
+  atomic_init(&pp.stop, 0);
+  pp.chunk_pool = malloc(PIPE_CHUNKS * sizeof(PipeChunk));
+  pp.batch_pool = calloc(PIPE_BATCHES, sizeof(PipeBatch));
+  if (!pp.chunk_pool || !pp.batch_pool) {
+    perror("malloc");
+    free(pp.chunk_pool);
+    free(pp.batch_pool);
+    fclose(in);
+    return 1;
+  }
+  for (int i = 0; i < PIPE_CHUNKS; i++)
+    ring_push(&pp.free_chunks, &pp.chunk_pool[i]);
+  for (int i = 0; i < PIPE_BATCHES; i++)
+    ring_push(&pp.free_batches, &pp.batch_pool[i]);
+
+  int rc = 0;
+  pthread_t reader, lexer;
+  int have_reader = pthread_create(&reader, NULL, pipe_reader, &pp) == 0;
+  if (!have_reader || pthread_create(&lexer, NULL, pipe_lexer, &pp) != 0) {
+    fprintf(stderr, "%s: cannot start pipeline threads\n", path);
+    if (have_reader) { // let the reader finish, then recycle its chunks
+      atomic_store(&pp.stop, 1);
+      PipeChunk *c;
+      do {
+        c = ring_pop(&pp.chunks);
+        ring_push(&pp.free_chunks, c);
+      } while (!c->last);
+      pthread_join(reader, NULL);
+    }
+    rc = 1;
+  } else {
+    int first = 1;
+    while (1) {
+      PipeBatch *b = ring_pop(&pp.batches);
+      if (first && !pp.skipped) { // decided before any batch is sent
+        if (opt->multi_file)
+          fprintf(out, "File: %s\n", path);
+        if (!opt->count)
+          print_listing_header(out);
+      }
+      first = 0;
+      for (size_t i = 0; i < b->n; i++)
+        print_token(out, &b->tokens[i]);
+      int last = b->last;
+      ring_push(&pp.free_batches, b);
+      if (last)
+        break;
+    }
+    pthread_join(lexer, NULL);
+    pthread_join(reader, NULL);
+
+    if (pp.read_err) {
+      fflush(out);
+      fprintf(stderr, "%s: %s\n", path, strerror(pp.read_err));
+      rc = 1;
+    } else if (pp.skipped) {
+      fflush(out);
+      fprintf(stderr, "Skipping binary file: %s\n", path);
+    } else if (pp.too_long) {
+      fflush(out);
+      fprintf(stderr, "%s: token at [%d:%d] is longer than %d bytes\n", path,
+              pp.long_line, pp.long_col, PIPE_MAX_TOKEN);
+      rc = 1;
+    } else if (opt->count) {
+      print_counts(out, pp.counts, opt->only, pp.lines, &pp.last);
+    }
+  }
+
+  for (int i = 0; i < PIPE_BATCHES; i++)
+    arena_free(&pp.batch_pool[i].arena);
+  free(pp.batch_pool);
+  free(pp.chunk_pool);
+  if (!is_stdin)
+    fclose(in);
+  return rc;
+}
+
+/* ---------- Identifier cross-reference index ---------- */
+// --index-build records where every identifier token occurs, as (file,
+// byte offset, line) postings, in an inverted index file; --index-query
+// looks names up in it. Unlike grep, strings and comments never match.
+//
+// Each worker lexes whole files into its own shard: a table of the distinct
+// names it has seen and a list of postings. The merge gives every name a
+// global id in sorted order, sizes the output file, maps it and scatters the
+// postings into place file by file, so each name's postings come out in file
+// and offset order without a sort. Queries map the file read-only and binary
+// search the sorted name table.
+//
+// The file is native-endian and made of fixed-size records: a header, then
+// the file table, the name table, the postings and the path and name bytes.
+//
+// --index-update keeps an index current without a rebuild. Each file record
+// holds the file's size, mtime and a 128-bit content hash. Files whose size
+// and mtime are unchanged are skipped, and files whose contents hash the
+// same only get their mtime patched. The rest are lexed into a new delta
+// segment, INDEX.1, INDEX.2 and so on, in the same format, counted in the
+// base file's header. Their old records, and those of deleted files, are
+// tombstoned in place; a query skips postings of tombstoned files. When the
+// segments or the dead postings pile up, a background process compacts
+// everything into a new base file.
+#define XREF_MAGIC "LXXREF\r\n"
+#define XREF_VERSION 2
+#define XREF_BYTE_ORDER 0x01020304u
+#define XREF_DELETED 1u        // XrefFileRec.flags: tombstone
+#define XREF_COMPACT_SEGMENTS 4 // compact when an update reaches this many
+
+typedef struct {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // XREF_BYTE_ORDER as written by the builder
+  uint64_t nfiles, nterms, npostings;
+  uint64_t files_off, terms_off, postings_off, strings_off, size;
+  uint64_t segments; // base file: delta segments INDEX.1 .. INDEX.segments
+} XrefHeader;
+
+typedef struct {
+  uint64_t size;     // bytes when lexed
+  int64_t mtime_ns;  // modification time when lexed
+  uint64_t hash[2];  // xref_content_hash() of the contents
+} XrefFileMeta;
+
+typedef struct {
+  uint64_t path_off; // into the string bytes
+  uint32_t path_len;
+  uint32_t flags; // XREF_DELETED
+  XrefFileMeta meta;
+  uint64_t npostings;
+} XrefFileRec;
+
+typedef struct {
+  uint64_t name_off; // into the string bytes
+  uint32_t name_len;
+  uint32_t nfiles;  // distinct files among the postings
+  uint64_t first;   // first posting
+  uint64_t count;
+} XrefTermRec;
+
+typedef struct {
+  uint32_t file;
+  uint32_t line;
+  uint64_t offset;
+} XrefPosting;
+
+typedef struct {
+  const char *text; // in the shard's arena
+  uint32_t len;
+  uint64_t hash;
+  uint64_t count; // postings in this shard
+} XrefTerm;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t term; // index + 1, 0 for an empty slot
+} XrefSlot;
+
+typedef struct {
+  uint32_t term; // shard-local
+  uint32_t line;
+  uint64_t offset;
+} ShardPosting;
+
+typedef struct {
+  Arena names;
+  XrefTerm *terms;
+  uint32_t nterms, terms_cap;
+  XrefSlot *slots; // open addressing, at most half full
+  size_t mask;
+  ShardPosting *postings;
+  size_t npostings, postings_cap;
+} XrefShard;
+
+// The postings of one file: a range of one shard's postings.
+typedef struct {
+  uint32_t shard;
+  size_t first, count;
+  int lexed; // 0 if unreadable or skipped as binary
+} XrefSpan;
+
+typedef struct {
+  char **paths;
+  size_t n;
+  int skip_binary;
+  XrefShard *shards;
+  int nshards;
+  XrefSpan *spans;    // indexed by file
+  XrefFileMeta *meta; // indexed by file
+  size_t next;        // next file to claim
+  int rc;
+  pthread_mutex_t lock;
+} XrefBuild;
+
+static void xref_grow_slots(XrefShard *sh) {
+  size_t cap = sh->slots ? (sh->mask + 1) * 2 : 1024;
+  XrefSlot *slots = calloc(cap, sizeof(XrefSlot));
+  if (!slots) {
+    perror("malloc");
+    exit(1);
+  }
+  for (uint32_t i = 0; i < sh->nterms; i++) {
+    size_t s = sh->terms[i].hash & (cap - 1);
+    while (slots[s].term)
+      s = (s + 1) & (cap - 1);
+    slots[s] = (XrefSlot){sh->terms[i].hash, i + 1};
+  }
+  free(sh->slots);
+  sh->slots = slots;
+  sh->mask = cap - 1;
+}
+
+// The shard-local id of a name, added on first sight.
+static uint32_t xref_term(XrefShard *sh, const char *s, uint32_t n,
+                          uint64_t hash) {
+  if (!sh->slots || (size_t)sh->nterms * 2 >= sh->mask + 1)
+    xref_grow_slots(sh);
+  size_t i = hash & sh->mask;
+  for (; sh->slots[i].term; i = (i + 1) & sh->mask) {
+    const XrefTerm *t = &sh->terms[sh->slots[i].term - 1];
+    if (sh->slots[i].hash == hash && t->len == n && memcmp(t->text, s, n) == 0)
+      return sh->slots[i].term - 1;
+  }
+  if (sh->nterms == sh->terms_cap) {
+    sh->terms_cap = sh->terms_cap ? sh->terms_cap * 2 : 1024;
+    sh->terms = realloc(sh->terms, sh->terms_cap * sizeof(XrefTerm));
+    if (!sh->terms) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  char *text = arena_alloc(&sh->names, n);
+  memcpy(text, s, n);
+  sh->terms[sh->nterms] = (XrefTerm){text, n, hash, 0};
+  sh->slots[i] = (XrefSlot){hash, sh->nterms + 1};
+  return sh->nterms++;
+}
+
+static void xref_add(XrefShard *sh, uint32_t term, int line, size_t offset) {
+  if (sh->npostings == sh->postings_cap) {
+    sh->postings_cap = sh->postings_cap ? sh->postings_cap * 2 : 4096;
+    sh->postings =
+        realloc(sh->postings, sh->postings_cap * sizeof(ShardPosting));
+    if (!sh->postings) {
+      perror("realloc");
+      exit(1);
+    }
+  }
+  sh->postings[sh->npostings++] = (ShardPosting){term, (uint32_t)line, offset};
+  sh->terms[term].count++;
+}
+
+static int64_t xref_mtime_ns(const struct stat *sb) {
+  return (int64_t)sb->st_mtim.tv_sec * 1000000000 + sb->st_mtim.tv_nsec;
+}
+
+// 128 bits in one pass, as two lanes with different seeds and mixing, so an
+// mtime-only change is told from an edit of the same size with no practical
+// chance of a collision. Reads past the end like lex_hash64().
+static void xref_content_hash(const unsigned char *p, size_t n,
+                              uint64_t out[2]) {
+  uint64_t a = HASH_SEED ^ n, b = 0x94d049bb133111ebULL ^ n, w;
+  for (; n >= 8; p += 8, n -= 8) {
+    memcpy(&w, p, 8);
+    a = hash_word(a, w);
+    b = (b ^ w) * 0xd6e8feb86659fd93ULL;
+    b ^= b >> 29;
+  }
+  if (n) {
+    memcpy(&w, p, 8);
+    w &= HASH_TAIL_MASK(n);
+    a = hash_word(a, w);
+    b = (b ^ w) * 0xd6e8feb86659fd93ULL;
+    b ^= b >> 29;
+  }
+  a ^= a >> 29;
+  a *= 0xbf58476d1ce4e5b9ULL;
+  b ^= b >> 31;
+  b *= 0x94d049bb133111ebULL;
+  out[0] = a ^ (a >> 32);
+  out[1] = b ^ (b >> 32);
+}
+
+// Lexes one file into the shard, identifiers only. Returns 0 on success.
+static int xref_index_file(XrefBuild *xb, XrefShard *sh, uint32_t shard,
+                           Lexer *lx, size_t file) {
+  const char *path = xb->paths[file];
+  XrefSpan *span = &xb->spans[file];
+  span->shard = shard;
+  span->first = sh->npostings;
+  span->count = 0;
+
+  // stat() before reading: if the file changes in between, the recorded
+  // mtime is the older one and the next update looks at the file again.
+  struct stat sb;
+  if (stat(path, &sb) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    return 1;
+  }
+  lexer_reset(lx);
+  size_t len;
+  char *src = read_file(path, &lx->arena, &len, stderr);
+  if (!src)
+    return 1;
+  xb->meta[file].size = len;
+  xb->meta[file].mtime_ns = xref_mtime_ns(&sb);
+  xref_content_hash((const unsigned char *)src, len, xb->meta[file].hash);
+  if (xb->skip_binary &&
+      memchr(src, '\0', len < BINARY_PROBE_LEN ? len : BINARY_PROBE_LEN)) {
+    fprintf(stderr, "Skipping binary file: %s\n", path);
+    return 0;
+  }
+  lexer_set_input(lx, src, len);
+  lx->type_mask = (1u << TOK_IDENTIFIER) | TOKEN_MASK_ALWAYS;
+  if (lex_use_index)
+    lexer_build_index(lx);
+
+  RawToken t;
+  while (1) {
+    next_wanted_raw_token(lx, &t);
+    if (t.type == TOK_EOF || t.type == TOK_ERROR)
+      break;
+    uint32_t n = t.len > MAX_ID_LEN ? MAX_ID_LEN : (uint32_t)t.len;
+    xref_add(sh, xref_term(sh, src + t.start, n, t.hash), t.line, t.start);
+  }
+  if (t.type == TOK_ERROR)
+    fprintf(stderr, "%s: stopped at error [%d:%d]: %s (indexed up to it)\n",
+            path, t.line, t.col, LEX_ERROR_MESSAGES[t.err]);
+  span->count = sh->npostings - span->first;
+  span->lexed = 1;
   return 0;
 }
+
+typedef struct {
+  XrefBuild *xb;
+  uint32_t shard;
+} XrefWorker;
+
+static void *xref_worker(void *arg) {
+  XrefWorker *w = arg;
+  XrefBuild *xb = w->xb;
+  XrefShard *sh = &xb->shards[w->shard];
+  Lexer lx;
+  lexer_init(&lx);
+  while (1) {
+    pthread_mutex_lock(&xb->lock);
+    size_t i = xb->next++;
+    pthread_mutex_unlock(&xb->lock);
+    if (i >= xb->n)
+      break;
+    if (xref_index_file(xb, sh, w->shard, &lx, i) != 0) {
+      pthread_mutex_lock(&xb->lock);
+      xb->rc = 1;
+      pthread_mutex_unlock(&xb->lock);
+    }
+  }
+  lexer_free(&lx);
+  return NULL;
+}
+
+static void xref_shard_free(XrefShard *sh) {
+  arena_free(&sh->names);
+  free(sh->terms);
+  free(sh->slots);
+  free(sh->postings);
+}
+
+// A name of one shard, for the global sort.
+typedef struct {
+  const XrefTerm *term;
+  uint32_t shard;
+  uint32_t local;
+} XrefRef;
+
+static int xref_name_cmp(const char *a, size_t an, const char *b, size_t bn) {
+  int c = memcmp(a, b, an < bn ? an : bn);
+  return c ? c : (an > bn) - (an < bn);
+}
+
+static int cmp_xref_ref(const void *a, const void *b) {
+  const XrefTerm *x = ((const XrefRef *)a)->term;
+  const XrefTerm *y = ((const XrefRef *)b)->term;
+  return xref_name_cmp(x->text, x->len, y->text, y->len);
+}
+
+static size_t xref_align8(size_t n) { return (n + 7) & ~(size_t)7; }
+
+// Merges the shards into out_path: written as out_path.tmp, mapped, filled
+// and renamed into place, so a reader never sees half an index.
+static int xref_write(XrefBuild *xb, const char *out_path,
+                      size_t *nterms_out, size_t *npostings_out,
+                      size_t *size_out) {
+  int nshards = xb->nshards;
+  // Global ids: all shard names sorted, equal names merged.
+  size_t nrefs = 0, npostings = 0;
+  for (int s = 0; s < nshards; s++) {
+    nrefs += xb->shards[s].nterms;
+    npostings += xb->shards[s].npostings;
+  }
+  XrefRef *refs = malloc((nrefs + 1) * sizeof(XrefRef));
+  uint32_t **global = malloc((size_t)nshards * sizeof(uint32_t *));
+  if (!refs || !global) {
+    perror("malloc");
+    exit(1);
+  }
+  nrefs = 0;
+  for (int s = 0; s < nshards; s++) {
+    global[s] = malloc((xb->shards[s].nterms + 1) * sizeof(uint32_t));
+    if (!global[s]) {
+      perror("malloc");
+      exit(1);
+    }
+    for (uint32_t i = 0; i < xb->shards[s].nterms; i++) {
+      if (xb->shards[s].terms[i].count) // names only dead files used go
+        refs[nrefs++] = (XrefRef){&xb->shards[s].terms[i], (uint32_t)s, i};
+    }
+  }
+  qsort(refs, nrefs, sizeof(XrefRef), cmp_xref_ref);
+  size_t nterms = 0;
+  for (size_t i = 0; i < nrefs; i++) {
+    if (nterms == 0 || cmp_xref_ref(&refs[nterms - 1], &refs[i]) != 0)
+      refs[nterms++] = refs[i]; // refs[g] now names global term g
+    global[refs[i].shard][refs[i].local] = (uint32_t)(nterms - 1);
+  }
+
+  // Layout.
+  size_t strings = 0;
+  for (size_t f = 0; f < xb->n; f++)
+    strings += strlen(xb->paths[f]);
+  for (size_t g = 0; g < nterms; g++)
+    strings += refs[g].term->len;
+  XrefHeader h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, XREF_MAGIC, sizeof(h.magic));
+  h.version = XREF_VERSION;
+  h.byte_order = XREF_BYTE_ORDER;
+  h.nfiles = xb->n;
+  h.nterms = nterms;
+  h.npostings = npostings;
+  h.files_off = xref_align8(sizeof(XrefHeader));
+  h.terms_off = h.files_off + xb->n * sizeof(XrefFileRec);
+  h.postings_off = h.terms_off + nterms * sizeof(XrefTermRec);
+  h.strings_off = h.postings_off + npostings * sizeof(XrefPosting);
+  h.size = h.strings_off + strings;
+
+  size_t tmp_len = strlen(out_path) + sizeof(".tmp");
+  char *tmp = malloc(tmp_len);
+  if (!tmp) {
+    perror("malloc");
+    exit(1);
+  }
+  snprintf(tmp, tmp_len, "%s.tmp", out_path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  char *base = MAP_FAILED;
+  if (fd < 0 || ftruncate(fd, (off_t)h.size) != 0 ||
+      (base = mmap(NULL, h.size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)) ==
+          MAP_FAILED) {
+    fprintf(stderr, "%s: %s\n", tmp, strerror(errno));
+    if (fd >= 0) {
+      close(fd);
+      unlink(tmp);
+    }
+    free(tmp);
+    for (int s = 0; s < nshards; s++)
+      free(global[s]);
+    free(global);
+    free(refs);
+    return 1;
+  }
+
+  memcpy(base, &h, sizeof(h));
+  XrefFileRec *files = (XrefFileRec *)(base + h.files_off);
+  XrefTermRec *terms = (XrefTermRec *)(base + h.terms_off);
+  XrefPosting *post = (XrefPosting *)(base + h.postings_off);
+  char *str = base + h.strings_off;
+  size_t so = 0;
+  for (size_t f = 0; f < xb->n; f++) {
+    size_t n = strlen(xb->paths[f]);
+    memcpy(str + so, xb->paths[f], n);
+    files[f] = (XrefFileRec){so, (uint32_t)n, 0, xb->meta[f], 0};
+    so += n;
+  }
+  for (size_t g = 0; g < nterms; g++) {
+    const XrefTerm *t = refs[g].term;
+    memcpy(str + so, t->text, t->len);
+    terms[g] = (XrefTermRec){so, t->len, 0, 0, 0};
+    so += t->len;
+  }
+  for (int s = 0; s < nshards; s++) {
+    for (uint32_t i = 0; i < xb->shards[s].nterms; i++) {
+      if (xb->shards[s].terms[i].count)
+        terms[global[s][i]].count += xb->shards[s].terms[i].count;
+    }
+  }
+  for (size_t g = 0, first = 0; g < nterms; g++) {
+    terms[g].first = first;
+    first += terms[g].count;
+    terms[g].count = 0; // the scatter below counts them again
+  }
+
+  // Scatter, one file at a time in file order.
+  uint32_t *last_file = calloc(nterms + 1, sizeof(uint32_t)); // file + 1
+  if (!last_file) {
+    perror("malloc");
+    exit(1);
+  }
+  for (size_t f = 0; f < xb->n; f++) {
+    const XrefSpan *sp = &xb->spans[f];
+    const ShardPosting *p = xb->shards[sp->shard].postings + sp->first;
+    const uint32_t *map = global[sp->shard];
+    files[f].npostings = sp->count;
+    for (size_t i = 0; i < sp->count; i++) {
+      uint32_t g = map[p[i].term];
+      XrefTermRec *t = &terms[g];
+      post[t->first + t->count++] =
+          (XrefPosting){(uint32_t)f, p[i].line, p[i].offset};
+      if (last_file[g] != f + 1) {
+        last_file[g] = (uint32_t)(f + 1);
+        t->nfiles++;
+      }
+    }
+  }
+  free(last_file);
+
+  int rc = 0;
+  if (munmap(base, h.size) != 0 || close(fd) != 0 ||
+      rename(tmp, out_path) != 0) {
+    fprintf(stderr, "%s: %s\n", out_path, strerror(errno));
+    unlink(tmp);
+    rc = 1;
+  }
+  free(tmp);
+  for (int s = 0; s < nshards; s++)
+    free(global[s]);
+  free(global);
+  free(refs);
+  *nterms_out = nterms;
+  *npostings_out = npostings;
+  *size_out = h.size;
+  return rc;
+}
+
+// Lexes paths[0..n) into xb with up to jobs shards, one per thread.
+static void xref_lex_files(XrefBuild *xb, char **paths, size_t n,
+                           int skip_binary, int jobs) {
+  if (jobs > (int)n)
+    jobs = n ? (int)n : 1;
+  memset(xb, 0, sizeof(*xb));
+  xb->paths = paths;
+  xb->n = n;
+  xb->skip_binary = skip_binary;
+  xb->shards = calloc((size_t)jobs, sizeof(XrefShard));
+  xb->spans = calloc(n + 1, sizeof(XrefSpan));
+  xb->meta = calloc(n + 1, sizeof(XrefFileMeta));
+  XrefWorker *workers = malloc(sizeof(XrefWorker) * (size_t)jobs);
+  pthread_t *tids = malloc(sizeof(pthread_t) * (size_t)jobs);
+  if (!xb->shards || !xb->spans || !xb->meta || !workers || !tids) {
+    perror("malloc");
+    exit(1);
+  }
+  pthread_mutex_init(&xb->lock, NULL);
+
+  // Worker 0 is the calling thread.
+  int started = 1;
+  for (int i = 0; i < jobs; i++)
+    workers[i] = (XrefWorker){xb, (uint32_t)i};
+  for (int i = 1; i < jobs; i++) {
+    if (pthread_create(&tids[i], NULL, xref_worker, &workers[i]) != 0)
+      break;
+    started++;
+  }
+  xref_worker(&workers[0]);
+  for (int i = 1; i < started; i++)
+    pthread_join(tids[i], NULL);
+  pthread_mutex_destroy(&xb->lock);
+  xb->nshards = started;
+  free(workers);
+  free(tids);
+}
+
+// Files that were lexed. Skipped and unreadable ones were reported as the
+// workers met them.
+static size_t xref_lexed(const XrefBuild *xb) {
+  size_t lexed = 0;
+  for (size_t i = 0; i < xb->n; i++)
+    lexed += xb->spans[i].lexed;
+  return lexed;
+}
+
+static void xref_build_free(XrefBuild *xb) {
+  for (int i = 0; i < xb->nshards; i++)
+    xref_shard_free(&xb->shards[i]);
+  free(xb->shards);
+  free(xb->spans);
+  free(xb->meta);
+}
+
+// "INDEX.k", the k-th delta segment of an index.
+static char *xref_segment_path(const char *index_path, uint64_t k) {
+  size_t n = strlen(index_path) + 24;
+  char *p = malloc(n);
+  if (!p) {
+    perror("malloc");
+    exit(1);
+  }
+  snprintf(p, n, "%s.%llu", index_path, (unsigned long long)k);
+  return p;
+}
+
+// Removes INDEX.1, INDEX.2, ... up to the first one that does not exist.
+static void xref_remove_segments(const char *index_path) {
+  for (uint64_t k = 1;; k++) {
+    char *seg = xref_segment_path(index_path, k);
+    int gone = unlink(seg) != 0;
+    free(seg);
+    if (gone)
+      break;
+  }
+}
+
+// Builders, updates and compactions of one index take turns on INDEX.lock.
+// Queries do not lock: files are only replaced by rename(), and tombstones
+// are single word stores. Returns the locked descriptor, or -1.
+static int xref_lock(const char *index_path) {
+  size_t n = strlen(index_path) + sizeof(".lock");
+  char *lock_path = malloc(n);
+  if (!lock_path) {
+    perror("malloc");
+    exit(1);
+  }
+  snprintf(lock_path, n, "%s.lock", index_path);
+  int fd = open(lock_path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0 || flock(fd, LOCK_EX) != 0) {
+    fprintf(stderr, "%s: %s\n", lock_path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+  }
+  free(lock_path);
+  return fd;
+}
+
+static int run_index_build(char **paths, size_t n, const LexOptions *opt,
+                           int jobs, const char *out_path) {
+  if (n > UINT32_MAX) {
+    fprintf(stderr, "--index-build: too many files (%zu)\n", n);
+    return 1;
+  }
+  int lock = xref_lock(out_path);
+  if (lock < 0)
+    return 1;
+  XrefBuild xb;
+  xref_lex_files(&xb, paths, n, opt->skip_binary, jobs);
+
+  size_t nterms, npostings, size;
+  int rc = xb.rc;
+  if (xref_write(&xb, out_path, &nterms, &npostings, &size) != 0) {
+    rc = 1;
+  } else {
+    xref_remove_segments(out_path); // left over from earlier updates
+    printf("Indexed %zu files: %zu identifiers, %zu uses, %zu bytes in %s\n",
+           xref_lexed(&xb), nterms, npostings, size, out_path);
+  }
+  xref_build_free(&xb);
+  close(lock);
+  return rc;
+}
+
+// A mapped index file, base or segment.
+typedef struct {
+  char *base;
+  size_t size;
+  XrefHeader *h;
+  XrefFileRec *files;
+  const XrefTermRec *terms;
+  const XrefPosting *postings;
+  const char *strings;
+} XrefMap;
+
+// Maps path; writable maps are shared so tombstones reach the file. Only
+// the header is checked here; queries check records as they read them, so
+// a query does not touch the whole file.
+static int xref_open(XrefMap *m, const char *path, int writable) {
+  int fd = open(path, writable ? O_RDWR : O_RDONLY);
+  struct stat sb;
+  if (fd < 0 || fstat(fd, &sb) != 0) {
+    fprintf(stderr, "%s: %s\n", path, strerror(errno));
+    if (fd >= 0)
+      close(fd);
+    return 1;
+  }
+  m->size = (size_t)sb.st_size;
+  m->base = m->size < sizeof(XrefHeader)
+                ? MAP_FAILED
+                : mmap(NULL, m->size,
+                       writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                       writable ? MAP_SHARED : MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (m->base == MAP_FAILED) {
+    fprintf(stderr, "%s: not an identifier index\n", path);
+    return 1;
+  }
+
+  const XrefHeader *h = m->h = (XrefHeader *)m->base;
+  if (memcmp(h->magic, XREF_MAGIC, sizeof(h->magic)) != 0 ||
+      h->version != XREF_VERSION || h->byte_order != XREF_BYTE_ORDER ||
+      h->size != m->size || h->nfiles > h->size || h->nterms > h->size ||
+      h->npostings > h->size || h->files_off != xref_align8(sizeof(*h)) ||
+      h->terms_off != h->files_off + h->nfiles * sizeof(XrefFileRec) ||
+      h->postings_off != h->terms_off + h->nterms * sizeof(XrefTermRec) ||
+      h->strings_off != h->postings_off + h->npostings * sizeof(XrefPosting) ||
+      h->strings_off > h->size) {
+    fprintf(stderr, "%s: not an identifier index, or built by another "
+                    "version or machine\n", path);
+    munmap(m->base, m->size);
+    return 1;
+  }
+  m->files = (XrefFileRec *)(m->base + h->files_off);
+  m->terms = (const XrefTermRec *)(m->base + h->terms_off);
+  m->postings = (const XrefPosting *)(m->base + h->postings_off);
+  m->strings = m->base + h->strings_off;
+  return 0;
+}
+
+// Whether off + len lies within the string bytes.
+static int xref_string_ok(const XrefMap *m, uint64_t off, uint64_t len) {
+  uint64_t n = m->h->size - m->h->strings_off;
+  return off <= n && len <= n - off;
+}
+
+static int xref_term_ok(const XrefMap *m, const XrefTermRec *t) {
+  return xref_string_ok(m, t->name_off, t->name_len) &&
+         t->first <= m->h->npostings && t->count <= m->h->npostings - t->first;
+}
+
+// Every record of m, for updates and compaction, which read them all.
+static int xref_check_all(const XrefMap *m) {
+  for (uint64_t i = 0; i < m->h->nfiles; i++) {
+    if (!xref_string_ok(m, m->files[i].path_off, m->files[i].path_len))
+      return 0;
+  }
+  for (uint64_t i = 0; i < m->h->nterms; i++) {
+    if (!xref_term_ok(m, &m->terms[i]))
+      return 0;
+  }
+  for (uint64_t i = 0; i < m->h->npostings; i++) {
+    if (m->postings[i].file >= m->h->nfiles)
+      return 0;
+  }
+  return 1;
+}
+
+// The base file and its delta segments, seg[0] being the base.
+typedef struct {
+  XrefMap *seg;
+  int n;
+} XrefIndex;
+
+static void xref_close(XrefIndex *ix) {
+  for (int i = 0; i < ix->n; i++)
+    munmap(ix->seg[i].base, ix->seg[i].size);
+  free(ix->seg);
+  ix->seg = NULL;
+  ix->n = 0;
+}
+
+// Maps the base file and every segment it lists. A compaction that lands
+// in between removes the segments; then the new base is opened instead.
+static int xref_index_open(XrefIndex *ix, const char *path, int writable) {
+  for (int attempt = 0; attempt < 3; attempt++) {
+    ix->n = 0;
+    ix->seg = malloc(sizeof(XrefMap));
+    if (!ix->seg) {
+      perror("malloc");
+      exit(1);
+    }
+    if (xref_open(&ix->seg[0], path, writable) != 0) {
+      free(ix->seg);
+      return 1;
+    }
+    ix->n = 1;
+    uint64_t nseg = ix->seg[0].h->segments;
+    if (nseg > 1 << 16) {
+      fprintf(stderr, "%s: corrupt identifier index\n", path);
+      xref_close(ix);
+      return 1;
+    }
+    ix->seg = realloc(ix->seg, (nseg + 1) * sizeof(XrefMap));
+    if (!ix->seg) {
+      perror("realloc");
+      exit(1);
+    }
+    int missing = 0;
+    for (uint64_t k = 1; k <= nseg && !missing; k++) {
+      char *seg = xref_segment_path(path, k);
+      if (access(seg, F_OK) != 0)
+        missing = 1;
+      else if (xref_open(&ix->seg[ix->n], seg, writable) == 0)
+        ix->n++;
+      else
+        missing = -1;
+      free(seg);
+    }
+    if (!missing)
+      return 0;
+    xref_close(ix);
+    if (missing < 0)
+      return 1;
+  }
+  fprintf(stderr, "%s: index keeps changing, try again\n", path);
+  return 1;
+}
+
+// The record for name, or NULL. *corrupt is set if a record on the way
+// points outside the file.
+static const XrefTermRec *xref_lookup(const XrefMap *m, const char *name,
+                                      size_t n, int *corrupt) {
+  size_t lo = 0, hi = m->h->nterms;
+  while (lo < hi) {
+    size_t mid = lo + (hi - lo) / 2;
+    const XrefTermRec *t = &m->terms[mid];
+    if (!xref_term_ok(m, t)) {
+      *corrupt = 1;
+      return NULL;
+    }
+    int c = xref_name_cmp(m->strings + t->name_off, t->name_len, name, n);
+    if (c == 0)
+      return t;
+    if (c < 0)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return NULL;
+}
+
+// The file of posting p, or NULL if the posting points outside m.
+static const XrefFileRec *xref_posting_file(const XrefMap *m,
+                                            const XrefPosting *p) {
+  if (p->file >= m->h->nfiles)
+    return NULL;
+  const XrefFileRec *f = &m->files[p->file];
+  return xref_string_ok(m, f->path_off, f->path_len) ? f : NULL;
+}
+
+// One live use of a name, from any segment.
+typedef struct {
+  const char *path; // in the mapped strings, not NUL-terminated
+  uint32_t path_len;
+  uint32_t line;
+  uint64_t offset;
+} XrefHit;
+
+static int cmp_xref_hit(const void *a, const void *b) {
+  const XrefHit *x = a, *y = b;
+  int c = xref_name_cmp(x->path, x->path_len, y->path, y->path_len);
+  if (c)
+    return c;
+  return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// --index-query: every use of each name, as "path:line @offset", in path
+// and then offset order whichever segments the uses are in. Returns 1 if
+// some name has no uses.
+static int run_index_query(const char *index_path, char **names,
+                           size_t nnames) {
+  XrefIndex ix;
+  if (xref_index_open(&ix, index_path, 0) != 0)
+    return 1;
+  XrefHit *hits = NULL;
+  size_t hits_cap = 0;
+  int rc = 0, corrupt = 0;
+  for (size_t i = 0; i < nnames && !corrupt; i++) {
+    size_t n = strlen(names[i]);
+    if (n > MAX_ID_LEN)
+      n = MAX_ID_LEN; // as the lexer stores it
+    size_t nhits = 0;
+    for (int s = 0; s < ix.n && !corrupt; s++) {
+      const XrefMap *m = &ix.seg[s];
+      const XrefTermRec *t = xref_lookup(m, names[i], n, &corrupt);
+      for (uint64_t k = 0; t && k < t->count; k++) {
+        const XrefPosting *p = &m->postings[t->first + k];
+        const XrefFileRec *f = xref_posting_file(m, p);
+        if (!f) {
+          corrupt = 1;
+          break;
+        }
+        if (f->flags & XREF_DELETED)
+          continue;
+        if (nhits == hits_cap) {
+          hits_cap = hits_cap ? hits_cap * 2 : 256;
+          hits = realloc(hits, hits_cap * sizeof(XrefHit));
+          if (!hits) {
+            perror("realloc");
+            exit(1);
+          }
+        }
+        hits[nhits++] = (XrefHit){m->strings + f->path_off, f->path_len,
+                                  p->line, p->offset};
+      }
+    }
+    if (corrupt)
+      break;
+    if (nhits == 0) {
+      printf("%.*s: no uses\n", (int)n, names[i]);
+      rc = 1;
+      continue;
+    }
+    // A fresh index over sorted paths is in order already.
+    size_t k = 1;
+    while (k < nhits && cmp_xref_hit(&hits[k - 1], &hits[k]) <= 0)
+      k++;
+    if (k < nhits)
+      qsort(hits, nhits, sizeof(XrefHit), cmp_xref_hit);
+    size_t nfiles = 1;
+    for (k = 1; k < nhits; k++)
+      nfiles += hits[k].path != hits[k - 1].path &&
+                xref_name_cmp(hits[k].path, hits[k].path_len,
+                              hits[k - 1].path, hits[k - 1].path_len) != 0;
+    printf("%.*s: %zu uses in %zu files\n", (int)n, names[i], nhits, nfiles);
+    for (k = 0; k < nhits; k++)
+      printf("  %.*s:%u @%llu\n", (int)hits[k].path_len, hits[k].path,
+             (unsigned)hits[k].line, (unsigned long long)hits[k].offset);
+  }
+  if (corrupt) {
+    fprintf(stderr, "%s: corrupt identifier index\n", index_path);
+    rc = 1;
+  }
+  free(hits);
+  xref_close(&ix);
+  return rc;
+}
+
+// A live file record of an open index.
+typedef struct {
+  const char *path; // in the mapped strings, not NUL-terminated
+  uint32_t len;
+  int seg;
+  uint32_t file;
+  int seen; // --index-update: still among the inputs
+} XrefLive;
+
+static int cmp_xref_live(const void *a, const void *b) {
+  const XrefLive *x = a, *y = b;
+  int c = xref_name_cmp(x->path, x->len, y->path, y->len);
+  return c ? c : (x->seg > y->seg) - (x->seg < y->seg);
+}
+
+// The live files of ix sorted by path. A path that is live in two segments
+// (an update that stopped between writing a segment and tombstoning) keeps
+// only its newest record; the older one is tombstoned here.
+static XrefLive *xref_live_files(XrefIndex *ix, size_t *n_out) {
+  size_t n = 0;
+  for (int s = 0; s < ix->n; s++)
+    n += ix->seg[s].h->nfiles;
+  XrefLive *live = malloc((n + 1) * sizeof(XrefLive));
+  if (!live) {
+    perror("malloc");
+    exit(1);
+  }
+  n = 0;
+  for (int s = 0; s < ix->n; s++) {
+    const XrefMap *m = &ix->seg[s];
+    for (uint32_t f = 0; f < m->h->nfiles; f++) {
+      if (!(m->files[f].flags & XREF_DELETED))
+        live[n++] = (XrefLive){m->strings + m->files[f].path_off,
+                               m->files[f].path_len, s, f, 0};
+    }
+  }
+  qsort(live, n, sizeof(XrefLive), cmp_xref_live);
+  size_t k = 0;
+  for (size_t i = 0; i < n; i++) {
+    const XrefLive *prev = k ? &live[k - 1] : NULL;
+    if (prev && xref_name_cmp(prev->path, prev->len, live[i].path,
+                              live[i].len) == 0) {
+      ix->seg[prev->seg].files[prev->file].flags |= XREF_DELETED;
+      k--;
+    }
+    live[k++] = live[i];
+  }
+  *n_out = k;
+  return live;
+}
+
+// Postings of live and of tombstoned files, over all segments.
+static void xref_count_postings(const XrefIndex *ix, uint64_t *live,
+                                uint64_t *dead) {
+  *live = *dead = 0;
+  for (int s = 0; s < ix->n; s++) {
+    const XrefMap *m = &ix->seg[s];
+    for (uint64_t f = 0; f < m->h->nfiles; f++) {
+      if (m->files[f].flags & XREF_DELETED)
+        *dead += m->files[f].npostings;
+      else
+        *live += m->files[f].npostings;
+    }
+  }
+}
+
+// Rewrites the index as a single base file holding only the live files,
+// in path order, without lexing anything: each segment becomes one shard
+// for xref_write(), its postings regrouped by file. Called with the lock
+// held.
+static int xref_compact(const char *index_path) {
+  XrefIndex ix;
+  if (xref_index_open(&ix, index_path, 1) != 0)
+    return 1;
+  for (int s = 0; s < ix.n; s++) {
+    if (!xref_check_all(&ix.seg[s])) {
+      fprintf(stderr, "%s: corrupt identifier index\n", index_path);
+      xref_close(&ix);
+      return 1;
+    }
+  }
+  size_t n;
+  XrefLive *live = xref_live_files(&ix, &n);
+
+  XrefBuild xb;
+  memset(&xb, 0, sizeof(xb));
+  xb.n = n;
+  xb.nshards = ix.n;
+  xb.paths = malloc((n + 1) * sizeof(char *));
+  xb.spans = calloc(n + 1, sizeof(XrefSpan));
+  xb.meta = calloc(n + 1, sizeof(XrefFileMeta));
+  xb.shards = calloc((size_t)ix.n, sizeof(XrefShard));
+  // new file id + 1 of each segment's files, 0 for dead ones
+  uint32_t **new_id = calloc((size_t)ix.n, sizeof(uint32_t *));
+  if (!xb.paths || !xb.spans || !xb.meta || !xb.shards || !new_id) {
+    perror("malloc");
+    exit(1);
+  }
+  for (int s = 0; s < ix.n; s++) {
+    new_id[s] = calloc(ix.seg[s].h->nfiles + 1, sizeof(uint32_t));
+    if (!new_id[s]) {
+      perror("malloc");
+      exit(1);
+    }
+  }
+  for (size_t f = 0; f < n; f++) {
+    const XrefFileRec *rec = &ix.seg[live[f].seg].files[live[f].file];
+    xb.paths[f] = strndup(live[f].path, live[f].len);
+    if (!xb.paths[f]) {
+      perror("malloc");
+      exit(1);
+    }
+    xb.meta[f] = rec->meta;
+    xb.spans[f].shard = (uint32_t)live[f].seg;
+    new_id[live[f].seg][live[f].file] = (uint32_t)(f + 1);
+  }
+
+  // Per segment: count the live postings of each file, then place them
+  // term by term, which keeps each name's postings in offset order.
+  for (int s = 0; s < ix.n; s++) {
+    const XrefMap *m = &ix.seg[s];
+    XrefShard *sh = &xb.shards[s];
+    sh->nterms = (uint32_t)m->h->nterms;
+    sh->terms = calloc(sh->nterms + 1, sizeof(XrefTerm));
+    size_t *next = calloc(m->h->nfiles + 1, sizeof(size_t));
+    if (!sh->terms || !next) {
+      perror("malloc");
+      exit(1);
+    }
+    for (uint32_t t = 0; t < sh->nterms; t++) {
+      const XrefTermRec *tr = &m->terms[t];
+      sh->terms[t].text = m->strings + tr->name_off;
+      sh->terms[t].len = tr->name_len;
+      for (uint64_t k = 0; k < tr->count; k++) {
+        uint32_t id = new_id[s][m->postings[tr->first + k].file];
+        if (id) {
+          xb.spans[id - 1].count++;
+          sh->terms[t].count++;
+          sh->npostings++;
+        }
+      }
+    }
+    size_t first = 0;
+    for (uint32_t f = 0; f < m->h->nfiles; f++) {
+      uint32_t id = new_id[s][f];
+      if (id) {
+        xb.spans[id - 1].first = next[f] = first;
+        first += xb.spans[id - 1].count;
+      }
+    }
+    sh->postings = malloc((sh->npostings + 1) * sizeof(ShardPosting));
+    if (!sh->postings) {
+      perror("malloc");
+      exit(1);
+    }
+    for (uint32_t t = 0; t < sh->nterms; t++) {
+      const XrefTermRec *tr = &m->terms[t];
+      for (uint64_t k = 0; k < tr->count; k++) {
+        const XrefPosting *p = &m->postings[tr->first + k];
+        if (new_id[s][p->file])
+          sh->postings[next[p->file]++] = (ShardPosting){t, p->line, p->offset};
+      }
+    }
+    free(next);
+  }
+
+  size_t nterms, npostings, size;
+  int rc = xref_write(&xb, index_path, &nterms, &npostings, &size);
+  if (rc == 0)
+    xref_remove_segments(index_path);
+
+  for (int s = 0; s < ix.n; s++) {
+    free(new_id[s]);
+    free(xb.shards[s].terms);
+    free(xb.shards[s].postings);
+  }
+  for (size_t f = 0; f < n; f++)
+    free(xb.paths[f]);
+  free(new_id);
+  free(xb.paths);
+  free(xb.spans);
+  free(xb.meta);
+  free(xb.shards);
+  free(live);
+  xref_close(&ix);
+  return rc;
+}
+
+// --index-compact: merge all segments now, in the foreground.
+static int run_index_compact(const char *index_path) {
+  if (access(index_path, F_OK) != 0) {
+    fprintf(stderr, "%s: %s\n", index_path, strerror(errno));
+    return 1;
+  }
+  int lock = xref_lock(index_path);
+  if (lock < 0)
+    return 1;
+  int rc = xref_compact(index_path);
+  if (rc == 0)
+    printf("Compacted %s\n", index_path);
+  close(lock);
+  return rc;
+}
+
+// Whether the file at path still matches rec: same size and mtime, or,
+// when only the mtime moved, the same contents (the mtime is then patched).
+static int xref_unchanged(XrefFileRec *rec, const char *path,
+                          const struct stat *sb) {
+  if ((uint64_t)sb->st_size != rec->meta.size)
+    return 0;
+  int64_t mtime = xref_mtime_ns(sb);
+  if (mtime == rec->meta.mtime_ns)
+    return 1;
+  Arena a = {0};
+  size_t len;
+  char *src = read_file(path, &a, &len, stderr);
+  uint64_t hash[2];
+  if (src)
+    xref_content_hash((const unsigned char *)src, len, hash);
+  int same = src && len == rec->meta.size && hash[0] == rec->meta.hash[0] &&
+             hash[1] == rec->meta.hash[1];
+  arena_free(&a);
+  if (same)
+    rec->meta.mtime_ns = mtime;
+  return same;
+}
+
+// --index-update: bring the index in line with the inputs, lexing only new
+// and changed files into a new segment and tombstoning the records they
+// replace and those of files no longer among the inputs. Builds the index
+// if it does not exist yet.
+static int run_index_update(char **paths, size_t n, const LexOptions *opt,
+                            int jobs, const char *index_path) {
+  if (access(index_path, F_OK) != 0 && errno == ENOENT)
+    return run_index_build(paths, n, opt, jobs, index_path);
+  int lock = xref_lock(index_path);
+  if (lock < 0)
+    return 1;
+  XrefIndex ix;
+  if (xref_index_open(&ix, index_path, 1) != 0) {
+    close(lock);
+    return 1;
+  }
+  for (int s = 0; s < ix.n; s++) {
+    if (!xref_check_all(&ix.seg[s])) {
+      fprintf(stderr, "%s: corrupt identifier index\n", index_path);
+      xref_close(&ix);
+      close(lock);
+      return 1;
+    }
+  }
+
+  size_t nlive, nlex = 0, unchanged = 0, added = 0, changed = 0, deleted = 0;
+  XrefLive *live = xref_live_files(&ix, &nlive);
+  char **lex = malloc((n + 1) * sizeof(char *));
+  XrefLive **replaced = malloc((n + 1) * sizeof(XrefLive *));
+  if (!lex || !replaced) {
+    perror("malloc");
+    exit(1);
+  }
+  int rc = 0;
+  for (size_t i = 0; i < n; i++) {
+    size_t len = strlen(paths[i]);
+    XrefLive *e = NULL;
+    for (size_t lo = 0, hi = nlive; !e && lo < hi;) {
+      size_t mid = lo + (hi - lo) / 2;
+      int c = xref_name_cmp(live[mid].path, live[mid].len, paths[i], len);
+      if (c == 0)
+        e = &live[mid];
+      else if (c < 0)
+        lo = mid + 1;
+      else
+        hi = mid;
+    }
+    struct stat sb;
+    if (stat(paths[i], &sb) != 0) {
+      fprintf(stderr, "%s: %s\n", paths[i], strerror(errno));
+      rc = 1;
+      continue; // tombstoned below if it was indexed
+    }
+    if (e && e->seen)
+      continue; // the same path given twice
+    if (e)
+      e->seen = 1;
+    if (e && xref_unchanged(&ix.seg[e->seg].files[e->file], paths[i], &sb)) {
+      unchanged++;
+      continue;
+    }
+    if (e) {
+      replaced[changed++] = e;
+    } else {
+      added++;
+    }
+    lex[nlex++] = paths[i];
+  }
+
+  // The new segment goes in before anything is tombstoned, so a crash in
+  // between leaves both records live rather than neither; the next update
+  // drops the older one.
+  uint64_t seg_no = ix.seg[0].h->segments + 1;
+  size_t nterms = 0, npostings = 0, size = 0, lexed = 0;
+  if (nlex > 0) {
+    XrefBuild xb;
+    xref_lex_files(&xb, lex, nlex, opt->skip_binary, jobs);
+    char *seg = xref_segment_path(index_path, seg_no);
+    if (xb.rc)
+      rc = 1;
+    if (xref_write(&xb, seg, &nterms, &npostings, &size) != 0) {
+      free(seg);
+      xref_build_free(&xb);
+      free(lex);
+      free(replaced);
+      free(live);
+      xref_close(&ix);
+      close(lock);
+      return 1;
+    }
+    free(seg);
+    lexed = xref_lexed(&xb);
+    xref_build_free(&xb);
+    ix.seg[0].h->segments = seg_no;
+  }
+  for (size_t i = 0; i < changed; i++)
+    ix.seg[replaced[i]->seg].files[replaced[i]->file].flags |= XREF_DELETED;
+  for (size_t i = 0; i < nlive; i++) {
+    if (!live[i].seen) {
+      ix.seg[live[i].seg].files[live[i].file].flags |= XREF_DELETED;
+      deleted++;
+    }
+  }
+  for (int s = 0; s < ix.n; s++) {
+    if (msync(ix.seg[s].base, ix.seg[s].size, MS_SYNC) != 0) {
+      fprintf(stderr, "%s: %s\n", index_path, strerror(errno));
+      rc = 1;
+    }
+  }
+
+  printf("Updated %s: %zu unchanged, %zu changed, %zu added, %zu deleted\n",
+         index_path, unchanged, changed, added, deleted);
+  if (nlex > 0)
+    printf("  segment %llu: %zu files, %zu identifiers, %zu uses, %zu bytes\n",
+           (unsigned long long)seg_no, lexed, nterms, npostings, size);
+
+  uint64_t live_postings, dead_postings;
+  xref_count_postings(&ix, &live_postings, &dead_postings);
+  int segments = (int)ix.seg[0].h->segments;
+  free(lex);
+  free(replaced);
+  free(live);
+  xref_close(&ix);
+
+  // Compaction runs in a child process that inherits the lock, so the
+  // update returns at once and the next update waits for the merge.
+  if (segments >= XREF_COMPACT_SEGMENTS || dead_postings > live_postings) {
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid == 0)
+      _exit(xref_compact(index_path) != 0);
+    if (pid > 0)
+      printf("  compacting %d segments in the background (pid %ld)\n",
+             segments, (long)pid);
+    else
+      rc |= xref_compact(index_path);
+  }
+  close(lock);
+  return rc;
+}
+
+// --symbols: the id -> text table after all files, in id order.
+static void print_symbols(FILE *out, Interner *in) {
+  uint32_t n = interner_count(in);
+  fprintf(out, "Symbol table (%u identifiers):\n", (unsigned)n);
+  for (uint32_t id = 1; id <= n; id++)
+    fprintf(out, "  #%-8u %s\n", (unsigned)id, symbol_name(in, id));
+}
+
+static void usage(const char *prog) {
+  printf("Usage: %s [--count] [--only=TYPE,...] [--symbols] [--stats] [--perf]\n"
+         "       [--comments] [--trivia | --roundtrip | --minify]\n"
+         "       [--fingerprint[=DIR] [--window=W] | --minhash[=T]]\n"
+         "       [--kgram=K]\n"
+         "       [--jobs=N [--dedupe] | --pipeline]\n"
+         "       [--engine=auto|index|avx2|sse42|scalar]\n"
+         "       <source_file | ->...\n",
+         prog);
+  printf("       %s [options] --dir=DIR [--ext=.c,.h]\n", prog);
+  printf("       %s --index-build=INDEX | --index-update=INDEX [--jobs=N]\n"
+         "       <source_file | --dir=DIR>...\n",
+         prog);
+  printf("       %s --index-compact=INDEX\n", prog);
+  printf("       %s --index-query=INDEX NAME...\n", prog);
+  printf("       %s --bench[=mix,...] [--bench-size=MB] [--bench-iters=N]\n",
+         prog);
+  printf("       %s --microbench[=scanner,...] [--microbench-tokens=N]\n",
+         prog);
+  printf("Example: %s test.txt\n", prog);
+}
+
+// Frees main()'s input lists and returns rc, on every exit once they exist.
+static int free_args(PathList *files, char **roots, int rc) {
+  pl_free(files);
+  free(roots);
+  return rc;
+}
+
+int main(int argc, char **argv) {
+  LexOptions opt = {0};
+  int want_perf = 0;
+  int jobs = 0;
+  const char *exts = ".c,.h";
+  int want_symbols = 0;
+  int want_comments = 0;
+  double minhash_threshold = 0;
+  const char *index_build = NULL;
+  const char *index_query = NULL;
+  const char *index_update = NULL;
+  int pipeline = 0;
+  int nroots = 0;
+  PathList files = {0};
+
+  if (argc < 2) {
+    usage(argv[0]);
+    return 1;
+  }
+  opt.only = TOKEN_MASK_ALL;
+
+  // The engine is chosen before anything is lexed, benchmarks included, so
+  // --engine may come before --bench.
+  const char *engine = NULL;
+  int first = 1;
+  for (int i = 1; i < argc; i++) {
+    if (strncmp(argv[i], "--engine=", 9) == 0)
+      engine = argv[i] + 9;
+  }
+  if (!select_engine(engine))
+    return 1;
+  while (first < argc - 1 && strncmp(argv[first], "--engine=", 9) == 0)
+    first++;
+
+  if (strncmp(argv[first], "--bench", 7) == 0)
+    return run_bench(argc - 1, argv + 1);
+  if (strncmp(argv[first], "--microbench", 12) == 0)
+    return run_microbench(argc - 1, argv + 1);
+
+  char **roots = calloc((size_t)argc, sizeof(char *));
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--count") == 0) {
+      opt.count = 1;
+    } else if (strcmp(argv[i], "--comments") == 0) {
+      want_comments = 1;
+    } else if (strcmp(argv[i], "--trivia") == 0) {
+      opt.trivia = 1;
+    } else if (strcmp(argv[i], "--roundtrip") == 0) {
+      opt.roundtrip = 1;
+    } else if (strcmp(argv[i], "--minify") == 0) {
+      opt.minify = 1;
+    } else if (strncmp(argv[i], "--fingerprint", 13) == 0 &&
+               (argv[i][13] == '\0' || argv[i][13] == '=')) {
+      opt.fingerprint = 1;
+      opt.fingerprint_dir = argv[i][13] ? argv[i] + 14 : NULL;
+    } else if (strncmp(argv[i], "--minhash", 9) == 0 &&
+               (argv[i][9] == '\0' || argv[i][9] == '=')) {
+      minhash_threshold =
+          argv[i][9] ? atof(argv[i] + 10) : MINHASH_THRESHOLD_DEFAULT;
+      if (!(minhash_threshold > 0 && minhash_threshold <= 1)) {
+        fprintf(stderr, "--minhash threshold must be in (0, 1]: %s\n",
+                argv[i] + 10);
+        return free_args(&files, roots, 1);
+      }
+    } else if (strncmp(argv[i], "--index-build=", 14) == 0) {
+      index_build = argv[i] + 14;
+    } else if (strncmp(argv[i], "--index-query=", 14) == 0) {
+      index_query = argv[i] + 14;
+    } else if (strncmp(argv[i], "--index-update=", 15) == 0) {
+      index_update = argv[i] + 15;
+    } else if (strncmp(argv[i], "--index-compact=", 16) == 0) {
+      return free_args(&files, roots, run_index_compact(argv[i] + 16));
+    } else if (strcmp(argv[i], "--dedupe") == 0) {
+      opt.dedupe = 1;
+    } else if (strncmp(argv[i], "--kgram=", 8) == 0) {
+      opt.kgram = atoi(argv[i] + 8);
+    } else if (strncmp(argv[i], "--window=", 9) == 0) {
+      opt.window = atoi(argv[i] + 9);
+    } else if (strncmp(argv[i], "--only=", 7) == 0) {
+      opt.only = parse_token_mask(argv[i] + 7);
+      if (!opt.only)
+        return free_args(&files, roots, 1);
+      opt.only |= TOKEN_MASK_ALWAYS;
+    } else if (strcmp(argv[i], "--stats") == 0) {
+#if LEXER_STATS
+      opt.stats = 1;
+#else
+      fprintf(stderr, "--stats is not available (built with LEXER_STATS=0)\n");
+      return free_args(&files, roots, 1);
+#endif
+    } else if (strcmp(argv[i], "--symbols") == 0) {
+      want_symbols = 1;
+    } else if (strcmp(argv[i], "--perf") == 0) {
+      want_perf = 1;
+    } else if (strncmp(argv[i], "--engine=", 9) == 0) {
+      // already applied
+    } else if (strcmp(argv[i], "--pipeline") == 0) {
+      pipeline = 1;
+    } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+      jobs = atoi(argv[i] + 7);
+    } else if (strncmp(argv[i], "--dir=", 6) == 0) {
+      roots[nroots++] = argv[i] + 6;
+    } else if (strncmp(argv[i], "--ext=", 6) == 0) {
+      exts = strcmp(argv[i] + 6, "*") == 0 ? NULL : argv[i] + 6;
+    } else if (strncmp(argv[i], "--", 2) == 0) {
+      fprintf(stderr, "Unknown option: %s\n", argv[i]);
+      usage(argv[0]);
+      return free_args(&files, roots, 1);
+    } else {
+      if (strcmp(argv[i], "-") == 0)
+        pipeline = 1; // stdin can only be streamed
+      pl_push(&files, strdup(argv[i]));
+    }
+  }
+  if (files.len == 0 && nroots == 0) {
+    usage(argv[0]);
+    return free_args(&files, roots, 1);
+  }
+  if (index_query) { // the arguments are names, not files
+    int rc = run_index_query(index_query, files.items, files.len);
+    return free_args(&files, roots, rc);
+  }
+  if (index_update) // same inputs and options as a build
+    index_build = index_update;
+  if (index_build &&
+      (opt.count || opt.trivia || opt.roundtrip || opt.minify ||
+       opt.fingerprint || minhash_threshold || opt.dedupe ||
+       opt.only != TOKEN_MASK_ALL || want_comments || want_symbols ||
+       opt.stats || want_perf || pipeline)) {
+    fprintf(stderr, "--index-build and --index-update cannot be combined "
+                    "with output options, --stats, --perf, --pipeline or "
+                    "stdin input\n");
+    return free_args(&files, roots, 1);
+  }
+  if (pipeline && (opt.stats || want_perf)) {
+    fprintf(stderr, "--pipeline and stdin input cannot be combined with "
+                    "--stats or --perf\n");
+    return free_args(&files, roots, 1);
+  }
+  if (want_comments)
+    opt.only |= 1u << TOK_COMMENT;
+  if (opt.trivia + opt.roundtrip + opt.minify + opt.fingerprint +
+          (minhash_threshold > 0) > 1) {
+    fprintf(stderr, "--trivia, --roundtrip, --minify, --fingerprint and "
+                    "--minhash are separate output modes; give only one\n");
+    return free_args(&files, roots, 1);
+  }
+  if ((opt.trivia || opt.roundtrip || opt.minify || opt.fingerprint ||
+       minhash_threshold) &&
+      (opt.count || opt.only != TOKEN_MASK_ALL || pipeline)) {
+    fprintf(stderr, "--trivia, --roundtrip, --minify, --fingerprint and "
+                    "--minhash need every token and cannot be combined with "
+                    "--count, --only, --comments, --pipeline or stdin input\n");
+    return free_args(&files, roots, 1);
+  }
+  if (opt.kgram <= 0)
+    opt.kgram = SHINGLE_K_DEFAULT;
+  if (opt.window <= 0)
+    opt.window = WINNOW_W_DEFAULT;
+  if (opt.fingerprint_dir && mkdir(opt.fingerprint_dir, 0777) != 0 &&
+      errno != EEXIST) {
+    fprintf(stderr, "%s: %s\n", opt.fingerprint_dir, strerror(errno));
+    return free_args(&files, roots, 1);
+  }
+  if (opt.dedupe && (pipeline || opt.fingerprint_dir)) {
+    fprintf(stderr, "--dedupe cannot be combined with --fingerprint=DIR, "
+                    "--pipeline or stdin input\n");
+    return free_args(&files, roots, 1);
+  }
+  if (pipeline && (opt.only & (1u << TOK_COMMENT))) {
+    fprintf(stderr, "--pipeline and stdin input cannot be combined with "
+                    "--comments\n");
+    return free_args(&files, roots, 1);
+  }
+  if (jobs <= 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    jobs = cpus > 0 ? (int)cpus : 1;
+  }
+
+  if (nroots > 0) {
+    walk_dirs(roots, nroots, exts, jobs, &files);
+    opt.skip_binary = 1;
+  }
+  opt.multi_file = files.len > 1 || nroots > 0;
+  if (want_perf) {
+    PerfCounters probe;
+    if (perf_open(&probe, 1) > 0) {
+      opt.perf = 1;
+      perf_close(&probe);
+    }
+  }
+
+  Interner *interner = NULL;
+  if (want_symbols) {
+    interner = malloc(sizeof(Interner));
+    if (!interner) {
+      perror("malloc");
+      return free_args(&files, roots, 1);
+    }
+    interner_init(interner);
+    opt.interner = interner;
+  }
+
+  MinHashSet minhash;
+  if (minhash_threshold) {
+    minhash_set_init(&minhash, minhash_threshold);
+    opt.minhash = &minhash;
+  }
+
+  int rc = 0;
+  if (index_update) {
+    rc = run_index_update(files.items, files.len, &opt, jobs, index_update);
+  } else if (index_build) {
+    rc = run_index_build(files.items, files.len, &opt, jobs, index_build);
+  } else if (pipeline) { // one file at a time, each through its own pipeline
+    for (size_t i = 0; i < files.len; i++) {
+      if (run_pipeline(files.items[i], &opt, stdout) != 0)
+        rc = 1;
+    }
+  } else {
+    rc = run_batch(files.items, files.len, &opt, jobs);
+  }
+  if (opt.minhash) {
+    minhash_report(stdout, opt.minhash);
+    minhash_set_free(opt.minhash);
+  }
+  if (interner) {
+    print_symbols(stdout, interner);
+    interner_free(interner);
+    free(interner);
+  }
+  return free_args(&files, roots, rc);
+}